@@ -0,0 +1,122 @@
+#ifndef __CHROME_TRACE_H__
+#define __CHROME_TRACE_H__
+/* 
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/*
+ * Timelines for --trace, written in Chrome's trace event format, which
+ * chrome://tracing and ui.perfetto.dev can open.  Each thread records
+ * spans into its own struct trace, so recording takes no locks, and
+ * they are all written out at the end.  Times are wall clock, so that
+ * traces from several processes line up when put together.
+ */
+
+struct trace_event {
+	char name[24];
+	const char *cat;
+	long long ts, dur;	/* microseconds */
+	long job;		/* -1 if none */
+	int nsamples;		/* -1 if none */
+};
+
+struct trace {
+	struct trace_event *ev;
+	int n, size;
+	long long stage_start[EXPLODOMATICA_NSTAGES];
+};
+
+static long long trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Record a span from start until now */
+static void trace_add(struct trace *t, const char *cat, const char *name,
+		long job, long long start, int nsamples)
+{
+	struct trace_event *ev;
+
+	if (t->n == t->size) {
+		ev = realloc(t->ev, sizeof(*ev) * (t->size ? t->size * 2 : 256));
+		if (!ev)
+			return;
+		t->ev = ev;
+		t->size = t->size ? t->size * 2 : 256;
+	}
+	ev = &t->ev[t->n++];
+	snprintf(ev->name, sizeof(ev->name), "%s", name);
+	ev->cat = cat;
+	ev->ts = start;
+	ev->dur = trace_now() - start;
+	ev->job = job;
+	ev->nsamples = nsamples;
+}
+
+/* For use from a stage hook */
+static void trace_stage(struct trace *t, struct explosion_def *e,
+		enum explodomatica_stage stage, int done, int nsamples)
+{
+	if (!done)
+		t->stage_start[stage] = trace_now();
+	else
+		trace_add(t, "stage", explodomatica_stage_name(stage), e->job_id,
+			t->stage_start[stage], nsamples);
+}
+
+/* Write one event per line, thread i of traces[] as tid i + 1.
+ * Returns 0, or -1 if filename can't be written.
+ */
+static int trace_write(const char *filename, const char *process_name, int pid,
+		struct trace *traces, int ntraces)
+{
+	struct trace_event *ev;
+	FILE *f;
+	int i, j;
+
+	f = fopen(filename, "w");
+	if (!f)
+		return -1;
+	fprintf(f, "{\"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+		"\"args\": {\"name\": \"%s\"}}", pid, process_name);
+	for (i = 0; i < ntraces; i++) {
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+			"\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}", pid, i + 1, i + 1);
+		for (j = 0; j < traces[i].n; j++) {
+			ev = &traces[i].ev[j];
+			fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+				"\"ts\": %lld, \"dur\": %lld, \"pid\": %d, \"tid\": %d, \"args\": {",
+				ev->name, ev->cat, ev->ts, ev->dur, pid, i + 1);
+			if (ev->job >= 0)
+				fprintf(f, "\"job\": %ld%s", ev->job, ev->nsamples >= 0 ? ", " : "");
+			if (ev->nsamples >= 0)
+				fprintf(f, "\"nsamples\": %d", ev->nsamples);
+			fprintf(f, "}}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+#endif
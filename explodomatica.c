@@ -36,6 +36,11 @@
 
 static struct explosion_def explodomatica_defaults = EXPLOSION_DEF_DEFAULTS;
 
+/* --sweep param=start:end:count */
+static char sweep_param[64];
+static double sweep_start, sweep_end;
+static int sweep_count = 0;
+
 void usage(void)
 {
 	fprintf(stderr, "usage:\n");
@@ -75,6 +80,17 @@ void usage(void)
 	fprintf(stderr, "  --noreverb      Suppress the 'reverb' effect\n");
 	fprintf(stderr, "  --input file    Use the given (44100Hz mono) wav file\n"
 			"                  as input instead of generating white noise for input.\n");
+	fprintf(stderr, "  --seed n        Seed for the random number generator.  The same\n");
+	fprintf(stderr, "                  seed and options always make the same explosion.\n");
+	fprintf(stderr, "                  Default is a different seed every time.\n");
+	fprintf(stderr, "  --fixed-point   Render with integer arithmetic only, for machines\n");
+	fprintf(stderr, "                  without fast floating point.  The result is very\n");
+	fprintf(stderr, "                  nearly the same.\n");
+	fprintf(stderr, "  --sweep param=start:end:count\n");
+	fprintf(stderr, "                  Make count explosions, with param (e.g. speedfactor\n");
+	fprintf(stderr, "                  or late-refls) going from start to end, saved as\n");
+	fprintf(stderr, "                  somefile-0.wav, somefile-1.wav, ...  Only the stages\n");
+	fprintf(stderr, "                  that depend on param are done more than once.\n");
 	exit(1);
 }
 
@@ -83,6 +99,7 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 	int option_index = 0;
 	int c, n, ival;
 	double dval;
+	char extra;
 
 	static struct option long_options[] = {
 		{"duration", 1, 0, 0},
@@ -94,6 +111,9 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 		{"pre-lp-count", 1, 0, 6},
 		{"noreverb", 0, 0, 7},
 		{"input", 1, 0, 8},
+		{"seed", 1, 0, 9},
+		{"sweep", 1, 0, 10},
+		{"fixed-point", 0, 0, 11},
 		{0, 0, 0, 0}
 	};
 
@@ -162,6 +182,26 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 			strncpy(e->input_file, optarg, PATH_MAX);
 			printf("input file: '%s'\n", e->input_file);
 			break;
+		case 9: /* seed */
+			n = sscanf(optarg, "%u", &e->seed);
+			if (n != 1)
+				usage();
+			printf("seed = %u\n", e->seed);
+			break;
+		case 10: /* sweep */
+			n = sscanf(optarg, "%63[^=]=%lg:%lg:%d%c", sweep_param,
+				&sweep_start, &sweep_end, &sweep_count, &extra);
+			if (n != 4 || sweep_count < 1) {
+				fprintf(stderr, "explodomatica: bad sweep '%s'\n", optarg);
+				usage();
+			}
+			printf("sweep %s from %g to %g in %d steps\n", sweep_param,
+				sweep_start, sweep_end, sweep_count);
+			break;
+		case 11: /* fixed-point */
+			printf("fixed point selected\n");
+			e->fixed_point = 1;
+			break;
 			
 		default:
 			usage();
@@ -174,6 +214,64 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 		usage();
 }
 
+/* somefile.wav -> somefile-3.wav */
+static void sweep_filename(char *buf, int buflen, const char *filename, int index)
+{
+	const char *ext = strrchr(filename, '.');
+
+	if (!ext || strchr(ext, '/'))
+		ext = filename + strlen(filename);
+	snprintf(buf, buflen, "%.*s-%d%s", (int) (ext - filename), filename, index, ext);
+}
+
+static void save_variant(struct explosion_def *e, int index, struct sound *s, void *arg)
+{
+	char filename[PATH_MAX + 32], params[1000], *p, *end;
+	int len = strlen(sweep_param);
+
+	(void) arg;
+	sweep_filename(filename, sizeof(filename), e->save_filename, index);
+	explodomatica_save_file(filename, s, 1);
+
+	/* report the value as the library rounded it */
+	explodomatica_canonical_params(e, params, sizeof(params));
+	for (p = params; p; p = strchr(p, ' ')) {
+		p += *p == ' ';
+		if (strncmp(p, sweep_param, len) == 0 && p[len] == '=')
+			break;
+	}
+	if (p) {
+		end = strchr(p, ' ');
+		if (end)
+			*end = '\0';
+		printf("%s: %s\n", filename, p);
+	}
+	free_sound(s);
+	free(s);
+}
+
+static int sweep(struct explosion_def *e)
+{
+	double *values;
+	int i, rc;
+
+	values = malloc(sizeof(*values) * sweep_count);
+	for (i = 0; i < sweep_count; i++) {
+		if (sweep_count == 1)
+			values[i] = sweep_start;
+		else
+			values[i] = sweep_start +
+				(sweep_end - sweep_start) * i / (sweep_count - 1);
+	}
+	rc = explodomatica_sweep(e, sweep_param, values, sweep_count, save_variant, NULL);
+	free(values);
+	if (rc != 0) {
+		fprintf(stderr, "explodomatica: unknown parameter '%s'\n", sweep_param);
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct timeval tv;
@@ -189,6 +287,8 @@ int main(int argc, char *argv[])
 		usage();
 
 	process_options(argc, argv, &e);
+	if (sweep_count)
+		return sweep(&e);
 	s = explodomatica(&e);
 	free_sound(s);
 
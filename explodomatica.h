@@ -32,6 +32,26 @@ struct sound {
         int nsamples;
 };
 
+/* The stages of explodomatica(), in the order they run */
+enum explodomatica_stage {
+	EXPLODOMATICA_STAGE_PREEXPLOSIONS,
+	EXPLODOMATICA_STAGE_EXPLOSION,
+	EXPLODOMATICA_STAGE_MIX,
+	EXPLODOMATICA_STAGE_SPEED,
+	EXPLODOMATICA_STAGE_REVERB,
+	EXPLODOMATICA_STAGE_SAVE,
+	EXPLODOMATICA_NSTAGES,
+};
+
+struct explosion_def;
+
+/* Called with done = 0 as a stage starts, and done = 1 when it ends
+ * (even if it was cut short by cancellation), in the rendering thread.
+ * nsamples is the length of the stage's output, 0 when starting.
+ */
+typedef void (*explodomatica_stage_hook)(struct explosion_def *e,
+		enum explodomatica_stage stage, int done, int nsamples);
+
 struct explosion_def {
 	char save_filename[PATH_MAX + 1];
 	char input_file[PATH_MAX + 1];
@@ -47,6 +67,12 @@ struct explosion_def {
 	int reverb_early_refls;
 	int reverb_late_refls;
 	int reverb; 
+	unsigned int seed;	/* same seed, same explosion.  0: random */
+	volatile int *cancel;	/* if set and becomes nonzero, give up */
+	explodomatica_stage_hook stage_hook;	/* optional */
+	void *hook_arg;		/* for the stage hook's use */
+	int fixed_point;	/* use the integer engine, see explodomatica.1 */
+	unsigned long job_id;	/* the caller's, passed to tracepoints */
 };
 
 /* Initializer for struct explosion_def */
@@ -65,10 +91,69 @@ struct explosion_def {
 	10,	/* final reverb early reflections */ \
 	50,	/* final reverb late reflections */ \
 	1,	/* reverb wanted? */ \
+	0,	/* seed */ \
+	NULL,	/* cancel */ \
+	NULL,	/* stage hook */ \
+	NULL,	/* hook arg */ \
+	0,	/* fixed point */ \
+	0,	/* job id */ \
 };
 
+/* Returns NULL if *e->cancel became nonzero during rendering.  It is
+ * checked between layers, pre-explosions and reverb reflections.
+ */
 GLOBAL struct sound *explodomatica(struct explosion_def *e);
 
+/* explodomatica() in two halves, so that the first half of one
+ * explosion can run alongside the second half of another, perhaps on
+ * another thread.  explodomatica_dry() makes everything up to the
+ * reverb into *p, returning -1 if cancelled; explodomatica_wet() then
+ * adds the reverb to p->s, consuming it, and returns what explodomatica()
+ * would have.  Neither saves the result.
+ */
+struct explodomatica_partial {
+	struct sound *s;
+	unsigned int rng_state;	/* where the reverb's random numbers start */
+	int finished;	/* s already is the result (the fixed point engine) */
+};
+
+GLOBAL int explodomatica_dry(struct explosion_def *e, struct explodomatica_partial *p);
+GLOBAL struct sound *explodomatica_wet(struct explosion_def *e,
+		struct explodomatica_partial *p);
+
+/* Frames [a, b) of what explodomatica(e) would return, for previews.
+ * Everything before the reverb is rendered in full, as it is cheap and
+ * needs the whole sound to normalize it, but the reverb, which is most
+ * of the work, is only computed for the frames asked for (plus the
+ * filter warm-up and reverb history they depend on).  The samples are
+ * the same to within rounding.  explodomatica() trims the silence
+ * from the end of the reverb, which can't be known without all of
+ * it, so frames up to twice the length of the dry sound are given,
+ * quiet past where explodomatica() would have stopped.  Nothing is
+ * saved.  Returns NULL if cancelled.
+ */
+GLOBAL struct sound *explodomatica_window(struct explosion_def *e, int a, int b);
+
+/* Called by explodomatica_stream() with frames [start, start + nframes)
+ * of the result as soon as they are finished, in order.  total is how
+ * many frames there will be in all, before the trailing silence is
+ * trimmed.  block points into the sound being made; copy what is needed.
+ */
+typedef void (*explodomatica_block_callback)(struct explosion_def *e,
+		const double *block, int start, int nframes, int total, void *arg);
+
+/* Render what explodomatica(e) would, handing each block_frames of it
+ * to f as it is done, so that the start can be played while the rest
+ * is still being made.  Until the reverb, nothing can be handed over,
+ * as the dry sound is normalized as a whole, but that part is quick;
+ * the reverb is then made a block at a time (as by explodomatica_window(),
+ * so the same to within rounding).  Returns the whole sound, trimmed
+ * as explodomatica() trims it, so the blocks may have run on past its
+ * end into the quiet tail.  Nothing is saved.  Returns NULL if cancelled.
+ */
+GLOBAL struct sound *explodomatica_stream(struct explosion_def *e, int block_frames,
+		explodomatica_block_callback f, void *arg);
+
 typedef void (*explodomatica_callback)(struct sound *s, void *arg);
 
 struct explodomatica_thread_arg {
@@ -80,7 +165,68 @@ struct explodomatica_thread_arg {
 GLOBAL void explodomatica_thread(pthread_t *t, struct explodomatica_thread_arg *arg);
 
 GLOBAL void free_sound(struct sound *s);
+GLOBAL const char *explodomatica_stage_name(enum explodomatica_stage stage);
 GLOBAL int explodomatica_save_file(char *filename, struct sound *s, int channels);
 GLOBAL void explodomatica_progress_variable(volatile float *progress);
 
+/* Nonzero to stop explodomatica() printing its progress on stdout */
+GLOBAL void explodomatica_quiet(int quiet);
+
+/* Set a parameter of *e by name, using the names of explodomatica's
+ * long options ("duration", "nlayers", "speedfactor", "seed", ...).
+ * Returns 0, or -1 if the name is unknown or the value doesn't parse.
+ */
+GLOBAL int explodomatica_set_param(struct explosion_def *e,
+		const char *name, const char *value);
+
+/* Rough figures for scheduling explodomatica(e): the most memory its
+ * sample buffers will use at once, and a cost roughly proportional to
+ * its running time (in passes over a sample).
+ */
+GLOBAL void explodomatica_estimate(struct explosion_def *e,
+		double *peak_bytes, double *cost);
+
+/* Called by explodomatica_render_many() and explodomatica_sweep() with
+ * each explosion as it is finished, which may not be in order.  e is
+ * the def it was made from, index its position in the list, and s is
+ * the caller's to free.
+ */
+typedef void (*explodomatica_sweep_callback)(struct explosion_def *e,
+		int index, struct sound *s, void *arg);
+
+/* Render every def in defs[0..n-1], each exactly as explodomatica()
+ * would, but doing each stage only once for defs with the same seed
+ * that agree on everything that stage depends on: defs that differ
+ * only in speedfactor share their layers and mix, those that differ
+ * only in the reverb also share the speed change, and those that differ
+ * only in late-refls share one reverb run.  Nothing is saved.  Returns
+ * 0, or -1 if rendering was cancelled (by any def's cancel flag).
+ */
+GLOBAL int explodomatica_render_many(struct explosion_def *defs, int n,
+		explodomatica_sweep_callback f, void *arg);
+
+/* Write the parameters that explodomatica_render_many() shares the mix
+ * over into buf, so that callers can tell which defs are worth rendering
+ * together.  Returns the length, 0 if e can't share (it has no seed, or
+ * uses the fixed point engine), or -1 if buf is too small.
+ */
+GLOBAL int explodomatica_mix_key(struct explosion_def *e, char *buf, int buflen);
+
+/* Render one explosion for each of values of the named parameter, with
+ * everything else as in *e, through explodomatica_render_many().  All
+ * variants get the same seed (a random one if e->seed is 0).  Returns
+ * 0, or -1 if the parameter is unknown or rendering was cancelled.
+ */
+GLOBAL int explodomatica_sweep(struct explosion_def *e, const char *param,
+		const double *values, int nvalues,
+		explodomatica_sweep_callback f, void *arg);
+
+/* Write every parameter of *e into buf as "name=value" pairs separated
+ * by spaces, always in the same order and format, so that two defs
+ * describing the same explosion produce the same string.  Returns the
+ * length, or -1 if buf is too small.
+ */
+GLOBAL int explodomatica_canonical_params(struct explosion_def *e,
+		char *buf, int buflen);
+
 #endif
@@ -0,0 +1,1718 @@
+
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/* explodomatica_batch: renders a manifest of explosions through a work
+ * queue kept in a directory, so that any number of worker processes on
+ * any number of hosts sharing that directory can drain it together.
+ *
+ * A manifest has one job per line:
+ *
+ *	output/path.wav name=value name=value ...
+ *
+ * with names as for explodomatica_set_param().  A job without a seed is
+ * given one derived from its line, so whichever worker renders it, and
+ * however many times, the output is the same.
+ *
+ * The queue directory holds
+ *
+ *	todo/NNNNNN			jobs nobody has claimed
+ *	claimed/NNNNNN@host.pid		jobs being rendered
+ *	done/NNNNNN			jobs whose output is in out/
+ *	merged/NNNNNN			finished jobs whose output merge moved
+ *	failed/NNNNNN			jobs that could not be rendered
+ *	out/...				rendered files
+ *
+ * Every transition is a rename(), which is atomic, so two workers can
+ * never claim the same job.  Workers touch every claim they hold every
+ * HEARTBEAT_SECS, however long its job takes; with --reclaim, claims
+ * nobody has touched for that long are assumed to belong to a dead
+ * worker and are put back in todo/.
+ *
+ * Each finished job is also appended to the worker's own file in
+ * journal.d/, with a hash of the job and of its output, so that work
+ * survives losing the queue state.  Every journal file has a single
+ * writer, as appends from different hosts aren't atomic over NFS.  A job whose output is already in out/ and matches the
+ * journal is not rendered again, whether it comes back through
+ * --reclaim, a re-run of init, or the verify command.
+ */
+#define _GNU_SOURCE	/* CPU_SET, pthread_setaffinity_np */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sched.h>
+
+#include "explodomatica.h"
+#include "chrome_trace.h"
+
+#define MAX_JOB_LINE 4096
+#define HEARTBEAT_SECS 2	/* how often claims are touched */
+#define JOB_NAME_LEN 6
+
+static struct explosion_def explodomatica_defaults = EXPLOSION_DEF_DEFAULTS;
+static char *queue_dir;
+static char worker_id[100];
+static int reclaim_secs = 0;
+static int trace_wanted = 0;
+
+/* Scheduling: jobs are tried longest first, and with --memory, only
+ * while their estimated peak memory fits under the limit.
+ */
+struct job_estimate {
+	int known;
+	double bytes;
+	double cost;
+	unsigned int group;	/* hash of its mix key, 0 if it can't share */
+};
+
+static struct job_estimate *estimates = NULL;
+static int nestimates = 0;
+static double memory_limit = 0.0;	/* bytes for this process, 0: no limit */
+static double memory_reserved = 0.0;	/* by jobs being rendered */
+static unsigned long memory_releases = 0;
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+/* The latest journal entry for each job, indexed by job number */
+struct journal_entry {
+	unsigned int job_hash;		/* of the job line, 0 if no entry */
+	unsigned long long out_hash;	/* of the output file */
+	long long bytes;
+	double seconds;			/* to render */
+};
+
+static struct journal_entry *journal = NULL;
+static int journal_size = 0;
+static off_t journal_loaded = 0;	/* bytes of all the journal files read */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* How much of each worker's journal has been read */
+struct journal_file {
+	char name[NAME_MAX + 1];
+	off_t loaded;
+};
+
+static struct journal_file *journal_files = NULL;
+static int njournal_files = 0;
+
+/* A claimed job.  Jobs with the same seed whose mix is the same are
+ * claimed together, up to MAX_GROUP of them, and rendered with
+ * explodomatica_render_many() so the stages they share are done once.
+ */
+#define MAX_GROUP 16
+
+struct job {
+	char name[NAME_MAX + 1];
+	char claimed[PATH_MAX];
+	char out[PATH_MAX];
+	char line[MAX_JOB_LINE];	/* output points into this */
+	char *output;
+	unsigned int job_hash;
+	enum { JOB_FAILED, JOB_VERIFIED, JOB_RENDERING, JOB_RENDERED } status;
+	struct job *next_held;	/* in held_jobs */
+};
+
+/* Every job this process has claimed and not yet finished, whichever
+ * thread or queue it is in, for the heartbeat thread to touch.
+ */
+static struct job *held_jobs = NULL;
+static pthread_mutex_t held_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t heartbeat_cond = PTHREAD_COND_INITIALIZER;
+static int heartbeat_stop = 0;
+
+struct worker {
+	long rendered;
+	long verified;
+	struct trace *trace;	/* NULL without --trace */
+	int cpu, node;		/* where it is pinned, or -1 */
+};
+
+/* With --pin, the CPUs this process may use, in the order workers are
+ * pinned to them: the first core of each NUMA node in turn, then the
+ * second, and so on, with the other hyperthreads of each core last.
+ */
+struct cpu_place {
+	int cpu;
+	int node;
+	int smt;	/* which of its core's threads it is */
+	int rank;	/* the how manyth core of its node */
+};
+
+static struct cpu_place *places = NULL;
+static int nplaces = 0;
+static int pin_wanted = 0;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "explodomatica_batch init queuedir manifest\n");
+	fprintf(stderr, "    Create a work queue in queuedir holding the jobs in manifest.\n");
+	fprintf(stderr, "    Each line of manifest is an output filename followed by\n");
+	fprintf(stderr, "    name=value parameters, e.g.\n");
+	fprintf(stderr, "        big/boom1.wav duration=6 nlayers=5 seed=17\n");
+	fprintf(stderr, "explodomatica_batch work [options] queuedir\n");
+	fprintf(stderr, "    Render jobs from the queue until there are none left.\n");
+	fprintf(stderr, "    Any number of workers may share a queue.\n");
+	fprintf(stderr, "    Jobs with the same seed and mix parameters, differing only\n");
+	fprintf(stderr, "    in speedfactor or reverb, are rendered together, sharing the mix.\n");
+	fprintf(stderr, "    --jobs n       Render n jobs at a time.  Default is the number of CPUs\n");
+	fprintf(stderr, "    --reclaim n    Put back claims that have not been touched for n\n");
+	fprintf(stderr, "                   seconds, assuming their worker died.  Workers\n");
+	fprintf(stderr, "                   touch their claims every %d seconds\n", HEARTBEAT_SECS);
+	fprintf(stderr, "    --memory size  Only start jobs while their estimated memory use\n");
+	fprintf(stderr, "                   adds up to less than size (e.g. 2G) for this worker\n");
+	fprintf(stderr, "    --pipeline     Overlap the stages of consecutive jobs: one job's\n");
+	fprintf(stderr, "                   reverb and save run while the next one's layers\n");
+	fprintf(stderr, "                   are made.  Jobs are not rendered together\n");
+	fprintf(stderr, "    --pin          Pin each thread to a CPU, spreading them over the\n");
+	fprintf(stderr, "                   NUMA nodes and cores, and keep each job's buffers\n");
+	fprintf(stderr, "                   and stages on the node of the thread that starts it\n");
+	fprintf(stderr, "    --trace        Record a timeline of every job and stage in\n");
+	fprintf(stderr, "                   queuedir/trace/, for the trace command\n");
+	fprintf(stderr, "explodomatica_batch status queuedir\n");
+	fprintf(stderr, "    Count the jobs in each state.\n");
+	fprintf(stderr, "explodomatica_batch trace queuedir file.json\n");
+	fprintf(stderr, "    Put the timelines of all workers run with --trace together\n");
+	fprintf(stderr, "    into one file for chrome://tracing or ui.perfetto.dev.\n");
+	fprintf(stderr, "explodomatica_batch verify queuedir\n");
+	fprintf(stderr, "    Check every finished output against the journal, and put\n");
+	fprintf(stderr, "    jobs whose output is missing or damaged back in the queue.\n");
+	fprintf(stderr, "explodomatica_batch merge queuedir destdir\n");
+	fprintf(stderr, "    Move the finished outputs into destdir, with an index.txt\n");
+	fprintf(stderr, "    listing each output and its parameters.  The jobs stay\n");
+	fprintf(stderr, "    finished, in merged/, and are not rendered again.\n");
+	exit(1);
+}
+
+static void queue_path(char *buf, const char *subdir, const char *name)
+{
+	snprintf(buf, PATH_MAX, "%s/%s%s%s", queue_dir, subdir,
+		name ? "/" : "", name ? name : "");
+}
+
+/* mkdir -p for the directories leading up to path */
+static int make_parent_dirs(const char *path)
+{
+	char dir[PATH_MAX], *p;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	return 0;
+}
+
+static int write_file(const char *path, const char *contents)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		return -1;
+	fputs(contents, f);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_job(const char *path, char *line, int linelen)
+{
+	FILE *f;
+	char *p;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(line, linelen, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	p = strchr(line, '\n');
+	if (p)
+		*p = '\0';
+	return 0;
+}
+
+/* Split a job line into its output filename and explosion parameters */
+static int parse_job(char *line, char **output, struct explosion_def *e)
+{
+	char *word, *value, *saveptr;
+
+	*output = strtok_r(line, " \t", &saveptr);
+	if (!*output || (*output)[0] == '/' || strstr(*output, ".."))
+		return -1;
+	while ((word = strtok_r(NULL, " \t", &saveptr))) {
+		value = strchr(word, '=');
+		if (!value)
+			return -1;
+		*value++ = '\0';
+		if (explodomatica_set_param(e, word, value) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* FNV-1a */
+static unsigned int hash_string(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* FNV-1a, 64 bit, of a whole file */
+static int hash_file(const char *path, unsigned long long *hash, long long *bytes)
+{
+	unsigned char buf[65536];
+	unsigned long long h = 14695981039346656037ull;
+	ssize_t n, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	*bytes = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			h ^= buf[i];
+			h *= 1099511628211ull;
+		}
+		*bytes += n;
+	}
+	close(fd);
+	if (n < 0)
+		return -1;
+	*hash = h;
+	return 0;
+}
+
+/* Read the lines of one journal file past *loaded.  Lines look like
+ *
+ *	job jobhash outhash bytes seconds worker output
+ *
+ * A line cut short by a crash is ignored.
+ */
+static void load_journal_file(const char *path, off_t *loaded)
+{
+	char line[MAX_JOB_LINE];
+	struct journal_entry je;
+	struct stat st;
+	int job, n;
+	FILE *f;
+
+	if (stat(path, &st) != 0 || st.st_size == *loaded)
+		return;
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	fseeko(f, *loaded, SEEK_SET);
+	while (fgets(line, sizeof(line), f)) {
+		if (!strchr(line, '\n'))
+			break;
+		*loaded += strlen(line);
+		journal_loaded += strlen(line);
+		if (sscanf(line, "%d %x %llx %lld %lg", &job, &je.job_hash,
+				&je.out_hash, &je.bytes, &je.seconds) != 5 || job < 0)
+			continue;
+		if (job >= journal_size) {
+			n = journal_size ? journal_size : 256;
+			while (n <= job)
+				n *= 2;
+			journal = realloc(journal, sizeof(*journal) * n);
+			memset(journal + journal_size, 0,
+				sizeof(*journal) * (n - journal_size));
+			journal_size = n;
+		}
+		journal[job] = je;
+	}
+	fclose(f);
+}
+
+/* Read any journal lines we haven't seen yet, from every worker's file
+ * (and the single shared file queues used to have).  A job rendered
+ * twice has the same output both times, so it doesn't matter which of
+ * its entries is kept.  Called with journal_mutex held.
+ */
+static void load_journal(void)
+{
+	static off_t shared_loaded = 0;
+	char path[PATH_MAX];
+	struct dirent *de;
+	int i;
+	DIR *d;
+
+	queue_path(path, "journal", NULL);
+	load_journal_file(path, &shared_loaded);
+
+	queue_path(path, "journal.d", NULL);
+	d = opendir(path);
+	if (!d)
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		for (i = 0; i < njournal_files; i++)
+			if (strcmp(journal_files[i].name, de->d_name) == 0)
+				break;
+		if (i == njournal_files) {
+			if (njournal_files % 64 == 0)
+				journal_files = realloc(journal_files,
+					sizeof(*journal_files) * (njournal_files + 64));
+			snprintf(journal_files[i].name, sizeof(journal_files[i].name),
+				"%s", de->d_name);
+			journal_files[i].loaded = 0;
+			njournal_files++;
+		}
+		queue_path(path, "journal.d", de->d_name);
+		load_journal_file(path, &journal_files[i].loaded);
+	}
+	closedir(d);
+}
+
+/* Whether job name is in merged/, its output moved out of the queue */
+static int job_merged(const char *name)
+{
+	char path[PATH_MAX];
+
+	queue_path(path, "merged", name);
+	return access(path, F_OK) == 0;
+}
+
+/* Whether the output of job name, whose job line hashes to job_hash, is
+ * already at path and matches what the journal says was written, or
+ * has been merged.
+ */
+static int output_verified(const char *name, unsigned int job_hash, const char *path)
+{
+	struct journal_entry je;
+	unsigned long long hash;
+	long long bytes;
+	struct stat st;
+	int job = atoi(name);
+
+	if (job_merged(name))
+		return 1;
+	if (stat(path, &st) != 0)
+		return 0;
+	pthread_mutex_lock(&journal_mutex);
+	load_journal();
+	memset(&je, 0, sizeof(je));
+	if (job < journal_size)
+		je = journal[job];
+	pthread_mutex_unlock(&journal_mutex);
+
+	if (je.job_hash != job_hash || je.bytes != (long long) st.st_size)
+		return 0;
+	return hash_file(path, &hash, &bytes) == 0 && hash == je.out_hash &&
+		bytes == je.bytes;
+}
+
+/* Append to this worker's journal file, which nothing else writes.  The
+ * worker's threads take turns, writing one line per write().
+ */
+static int append_journal(const char *name, unsigned int job_hash,
+		const char *path, const char *output, double seconds)
+{
+	char journal_path[PATH_MAX], line[MAX_JOB_LINE], file[NAME_MAX + 1];
+	unsigned long long hash;
+	long long bytes;
+	int fd, len, rc;
+
+	if (hash_file(path, &hash, &bytes) != 0)
+		return -1;
+	len = snprintf(line, sizeof(line), "%s %08x %016llx %lld %.3f %s %s\n",
+		name, job_hash, hash, bytes, seconds, worker_id, output);
+	if (len >= (int) sizeof(line))
+		return -1;
+	queue_path(journal_path, "journal.d", NULL);
+	mkdir(journal_path, 0777);	/* queues made before journal.d/ */
+	snprintf(file, sizeof(file), "%s", worker_id);
+	queue_path(journal_path, "journal.d", file);
+	pthread_mutex_lock(&journal_mutex);
+	fd = open(journal_path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (fd < 0) {
+		pthread_mutex_unlock(&journal_mutex);
+		return -1;
+	}
+	rc = write(fd, line, len) == len ? 0 : -1;
+	if (fdatasync(fd) != 0)
+		rc = -1;
+	close(fd);
+	pthread_mutex_unlock(&journal_mutex);
+	return rc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Whether job name is in done/, merged/ or claimed/ already */
+static int job_exists(const char *name)
+{
+	char path[PATH_MAX], prefix[NAME_MAX + 1];
+	struct dirent *de;
+	int found = 0;
+	DIR *d;
+
+	queue_path(path, "done", name);
+	if (access(path, F_OK) == 0 || job_merged(name))
+		return 1;
+	snprintf(prefix, sizeof(prefix), "%s@", name);
+	queue_path(path, "claimed", NULL);
+	d = opendir(path);
+	if (!d)
+		return 0;
+	while (!found && (de = readdir(d)))
+		found = strncmp(de->d_name, prefix, strlen(prefix)) == 0;
+	closedir(d);
+	return found;
+}
+
+static int init_queue(char *manifest)
+{
+	static const char *subdirs[] = { "todo", "claimed", "done", "merged", "failed", "out",
+		"journal.d" };
+	char path[PATH_MAX], out[PATH_MAX], line[MAX_JOB_LINE], job[MAX_JOB_LINE + 32];
+	char check[MAX_JOB_LINE], name[32], *p, *output;
+	struct explosion_def e;
+	unsigned int i;
+	int njobs = 0, nfinished = 0, lineno = 0;
+	FILE *f;
+
+	if (mkdir(queue_dir, 0777) < 0 && errno != EEXIST)
+		goto fail;
+	for (i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+		queue_path(path, subdirs[i], NULL);
+		if (mkdir(path, 0777) < 0 && errno != EEXIST)
+			goto fail;
+	}
+
+	f = fopen(manifest, "r");
+	if (!f) {
+		fprintf(stderr, "explodomatica_batch: cannot open '%s': %s\n",
+			manifest, strerror(errno));
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = strchr(line, '\n');
+		if (p)
+			*p = '\0';
+		p = line + strspn(line, " \t");
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		strcpy(check, p);
+		e = explodomatica_defaults;
+		if (parse_job(check, &output, &e) != 0) {
+			fprintf(stderr, "explodomatica_batch: %s:%d: bad job\n", manifest, lineno);
+			fclose(f);
+			return 1;
+		}
+		if (e.seed == 0)
+			snprintf(job, sizeof(job), "%s seed=%u", p, hash_string(p) | 1);
+		else
+			snprintf(job, sizeof(job), "%s", p);
+
+		snprintf(name, sizeof(name), "%0*d", JOB_NAME_LEN, njobs++);
+		if (job_exists(name))
+			continue;
+		/* resuming: finished jobs go straight to done/ */
+		queue_path(out, "out", output);
+		if (output_verified(name, hash_string(job), out)) {
+			queue_path(path, "done", name);
+			nfinished++;
+		} else {
+			queue_path(path, "todo", name);
+		}
+		strcat(job, "\n");
+		if (write_file(path, job) != 0)
+			goto fail;
+	}
+	fclose(f);
+	printf("%d jobs queued in %s", njobs, queue_dir);
+	if (nfinished)
+		printf(", %d already finished", nfinished);
+	printf("\n");
+	return 0;
+
+fail:
+	fprintf(stderr, "explodomatica_batch: cannot set up '%s': %s\n",
+		queue_dir, strerror(errno));
+	return 1;
+}
+
+/* Put claims nobody has touched for reclaim_secs back in todo/ */
+static void reclaim_stale_claims(void)
+{
+	char path[PATH_MAX], todo[PATH_MAX], name[NAME_MAX + 1];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	queue_path(path, "claimed", NULL);
+	d = opendir(path);
+	if (!d)
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' || !strchr(de->d_name, '@'))
+			continue;
+		queue_path(path, "claimed", de->d_name);
+		if (stat(path, &st) != 0 || time(NULL) - st.st_mtime < reclaim_secs)
+			continue;
+		snprintf(name, sizeof(name), "%s", de->d_name);
+		*strchr(name, '@') = '\0';
+		queue_path(todo, "todo", name);
+		if (rename(path, todo) == 0)
+			printf("reclaimed job %s from %s\n", name, strchr(de->d_name, '@') + 1);
+	}
+	closedir(d);
+}
+
+struct job_list {
+	char (*name)[NAME_MAX + 1];	/* "" once claimed, by anyone */
+	int n;
+};
+
+/* Work out (once) the cost and memory of job name, from todo/ */
+static struct job_estimate estimate_job(const char *name)
+{
+	struct explosion_def e = explodomatica_defaults;
+	struct job_estimate je = { 0, 0.0, 0.0, 0 };
+	char path[PATH_MAX], line[MAX_JOB_LINE], key[MAX_JOB_LINE], *output;
+	int job = atoi(name), n;
+
+	pthread_mutex_lock(&sched_mutex);
+	if (job < nestimates)
+		je = estimates[job];
+	pthread_mutex_unlock(&sched_mutex);
+	if (je.known)
+		return je;
+
+	queue_path(path, "todo", name);
+	if (read_job(path, line, sizeof(line)) != 0)
+		return je;	/* already claimed; try again if it comes back */
+	if (parse_job(line, &output, &e) == 0) {
+		explodomatica_estimate(&e, &je.bytes, &je.cost);
+		if (explodomatica_mix_key(&e, key, sizeof(key)) > 0)
+			je.group = hash_string(key) | 1;
+	}
+	je.known = 1;
+
+	pthread_mutex_lock(&sched_mutex);
+	if (job >= nestimates) {
+		n = nestimates ? nestimates : 256;
+		while (n <= job)
+			n *= 2;
+		estimates = realloc(estimates, sizeof(*estimates) * n);
+		memset(estimates + nestimates, 0, sizeof(*estimates) * (n - nestimates));
+		nestimates = n;
+	}
+	estimates[job] = je;
+	pthread_mutex_unlock(&sched_mutex);
+	return je;
+}
+
+static int longest_first(const void *a, const void *b)
+{
+	double ca = estimate_job(a).cost, cb = estimate_job(b).cost;
+
+	if (ca != cb)
+		return ca < cb ? 1 : -1;
+	return strcmp(a, b);
+}
+
+static void list_todo(struct job_list *l)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	int allocated = 0, i;
+	DIR *d;
+
+	l->n = 0;
+	queue_path(path, "todo", NULL);
+	d = opendir(path);
+	if (!d)
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' || strstr(de->d_name, ".tmp"))
+			continue;
+		if (l->n == allocated) {
+			allocated = allocated ? allocated * 2 : 256;
+			l->name = realloc(l->name, sizeof(*l->name) * allocated);
+		}
+		strcpy(l->name[l->n++], de->d_name);
+	}
+	closedir(d);
+	/* so qsort doesn't read job files with the lock held */
+	for (i = 0; i < l->n; i++)
+		estimate_job(l->name[i]);
+	qsort(l->name, l->n, sizeof(*l->name), longest_first);
+}
+
+/* Reserve memory for a job, if it fits, or if nothing else is running */
+static int admit_job(double bytes, unsigned long *releases)
+{
+	int admitted = 1;
+
+	pthread_mutex_lock(&sched_mutex);
+	if (memory_limit > 0.0 && memory_reserved > 0.0 &&
+			memory_reserved + bytes > memory_limit) {
+		admitted = 0;
+		*releases = memory_releases;
+	} else {
+		memory_reserved += bytes;
+	}
+	pthread_mutex_unlock(&sched_mutex);
+	return admitted;
+}
+
+static void release_job(double bytes)
+{
+	pthread_mutex_lock(&sched_mutex);
+	memory_reserved -= bytes;
+	if (memory_reserved < 1.0)
+		memory_reserved = 0.0;
+	memory_releases++;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_mutex);
+}
+
+static int try_claim(struct job_list *l, int i, struct job *job)
+{
+	char todo[PATH_MAX], claim[NAME_MAX + 1 + sizeof(worker_id)];
+
+	strcpy(job->name, l->name[i]);
+	l->name[i][0] = '\0';
+	queue_path(todo, "todo", job->name);
+	snprintf(claim, sizeof(claim), "%s@%s", job->name, worker_id);
+	queue_path(job->claimed, "claimed", claim);
+	if (rename(todo, job->claimed) != 0)
+		return 0;
+	pthread_mutex_lock(&held_mutex);
+	job->next_held = held_jobs;
+	held_jobs = job;
+	pthread_mutex_unlock(&held_mutex);
+	return 1;
+}
+
+/* Stop touching a claim, before it is moved on */
+static void drop_claim(struct job *job)
+{
+	struct job **p;
+
+	pthread_mutex_lock(&held_mutex);
+	for (p = &held_jobs; *p; p = &(*p)->next_held)
+		if (*p == job) {
+			*p = job->next_held;
+			break;
+		}
+	pthread_mutex_unlock(&held_mutex);
+}
+
+/* Keeps every claim we hold fresh, so none is reclaimed while we work
+ * on it, even in the middle of a long stage or waiting in a queue.
+ */
+static void *heartbeat_thread(__attribute__((unused)) void *arg)
+{
+	struct timespec deadline;
+	struct job *job;
+
+	pthread_mutex_lock(&held_mutex);
+	while (!heartbeat_stop) {
+		for (job = held_jobs; job; job = job->next_held)
+			utime(job->claimed, NULL);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += HEARTBEAT_SECS;
+		pthread_cond_timedwait(&heartbeat_cond, &held_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&held_mutex);
+	return NULL;
+}
+
+/* Claim more jobs in the same group as jobs[0], as memory allows */
+static int claim_group(struct job_list *l, struct job *jobs, double *reserved)
+{
+	unsigned int group = estimate_job(jobs[0].name).group;
+	struct job_estimate je;
+	unsigned long releases;
+	int i, n = 1;
+
+	if (!group)
+		return n;
+	for (i = 0; i < l->n && n < MAX_GROUP; i++) {
+		if (!l->name[i][0])
+			continue;
+		je = estimate_job(l->name[i]);
+		if (je.group != group || !admit_job(je.bytes, &releases))
+			continue;
+		if (try_claim(l, i, &jobs[n])) {
+			*reserved += je.bytes;
+			n++;
+		} else {
+			release_job(je.bytes);
+		}
+	}
+	return n;
+}
+
+/* Claim a job, returning its name and the memory reserved for it, or 0
+ * if there are none left.  If there are jobs but not the memory for
+ * any of them, waits for some to be released, or returns -1 if wait
+ * is 0.
+ */
+static int claim_job(struct job_list *l, struct job *job, double *reserved, int wait)
+{
+	unsigned long releases;
+	struct job_estimate je;
+	int i, refreshed = 0, waiting;
+
+	while (1) {
+		waiting = 0;
+		for (i = 0; i < l->n; i++) {
+			if (!l->name[i][0])
+				continue;
+			je = estimate_job(l->name[i]);
+			if (!admit_job(je.bytes, &releases)) {
+				waiting = 1;
+				continue;
+			}
+			if (try_claim(l, i, job)) {
+				*reserved = je.bytes;
+				return 1;
+			}
+			release_job(je.bytes);
+		}
+		if (waiting) {
+			/* there is work, but not the memory for it yet */
+			if (!wait)
+				return -1;
+			pthread_mutex_lock(&sched_mutex);
+			while (memory_releases == releases)
+				pthread_cond_wait(&sched_cond, &sched_mutex);
+			pthread_mutex_unlock(&sched_mutex);
+			refreshed = 0;
+			continue;
+		}
+		if (refreshed)
+			return 0;
+		if (reclaim_secs)
+			reclaim_stale_claims();
+		list_todo(l);
+		refreshed = 1;
+	}
+}
+
+/* Stage hook: puts the stages in the trace of the thread running them */
+static void trace_hook(struct explosion_def *e, enum explodomatica_stage stage,
+		int done, int nsamples)
+{
+	struct worker *w = e->hook_arg;
+
+	if (w->trace)
+		trace_stage(w->trace, e, stage, done, nsamples);
+}
+
+/* Called by explodomatica_render_many() with each finished job */
+static void save_job(struct explosion_def *e, int index, struct sound *s, void *arg)
+{
+	struct job **def_job = arg;
+	struct job *job = def_job[index];
+
+	trace_hook(e, EXPLODOMATICA_STAGE_SAVE, 0, 0);
+	if (explodomatica_save_file(e->save_filename, s, 1) == 0)
+		job->status = JOB_RENDERED;
+	trace_hook(e, EXPLODOMATICA_STAGE_SAVE, 1, s->nsamples);
+	free_sound(s);
+	free(s);
+}
+
+/* Read a claimed job into *e, ready to render to a temporary file,
+ * unless the journal shows it is already finished.  Sets its status.
+ */
+static void prepare_job(struct worker *w, struct job *job, struct explosion_def *e)
+{
+	*e = explodomatica_defaults;
+	job->status = JOB_FAILED;
+	if (read_job(job->claimed, job->line, sizeof(job->line)) != 0)
+		return;
+	job->job_hash = hash_string(job->line);
+	if (parse_job(job->line, &job->output, e) != 0)
+		return;
+	queue_path(job->out, "out", job->output);
+	if (output_verified(job->name, job->job_hash, job->out)) {
+		job->status = JOB_VERIFIED;
+		return;
+	}
+	if (make_parent_dirs(job->out) != 0)
+		return;
+	if (snprintf(e->save_filename, sizeof(e->save_filename), "%s.%s.tmp",
+			job->out, worker_id) >= (int) sizeof(e->save_filename))
+		return;
+	e->job_id = atol(job->name);
+	e->stage_hook = trace_hook;
+	e->hook_arg = w;
+	job->status = JOB_RENDERING;
+}
+
+/* Move a rendered job's output into place and journal it */
+static void commit_job(struct job *job, struct explosion_def *e, double seconds)
+{
+	if (job->status != JOB_RENDERED || rename(e->save_filename, job->out) != 0 ||
+			append_journal(job->name, job->job_hash, job->out,
+				job->output, seconds) != 0) {
+		unlink(e->save_filename);
+		job->status = JOB_FAILED;
+	}
+}
+
+/* Move a claim to done/ or failed/ (or drop it, if merged already) */
+static void finish_job(struct worker *w, struct job *job)
+{
+	char finished[PATH_MAX];
+
+	drop_claim(job);
+	if (job->status == JOB_VERIFIED && job_merged(job->name)) {
+		unlink(job->claimed);
+		w->verified++;
+		return;
+	}
+	if (job->status == JOB_FAILED) {
+		queue_path(finished, "failed", job->name);
+		fprintf(stderr, "explodomatica_batch: job %s failed\n", job->name);
+	} else {
+		queue_path(finished, "done", job->name);
+		if (job->status == JOB_VERIFIED)
+			w->verified++;
+		else
+			w->rendered++;
+	}
+	rename(job->claimed, finished);
+}
+
+/* Render claimed jobs, except those the journal shows are already
+ * finished, setting the status of each.
+ */
+static void render_group(struct worker *w, struct job *jobs, int njobs)
+{
+	struct explosion_def defs[MAX_GROUP];
+	struct job *def_job[MAX_GROUP];
+	int i, n = 0;
+	double seconds;
+
+	for (i = 0; i < njobs; i++) {
+		prepare_job(w, &jobs[i], &defs[n]);
+		if (jobs[i].status == JOB_RENDERING)
+			def_job[n++] = &jobs[i];
+	}
+	if (!n)
+		return;
+
+	seconds = now();
+	explodomatica_render_many(defs, n, save_job, def_job);
+	seconds = (now() - seconds) / n;
+
+	for (i = 0; i < n; i++)
+		commit_job(def_job[i], &defs[i], seconds);
+}
+
+/* Put a span for jobs[0..n-1], from started until now, in w's trace */
+static void trace_jobs(struct worker *w, struct job *jobs, int n, long long started)
+{
+	char span[32];
+
+	if (!w->trace)
+		return;
+	if (n > 1)
+		snprintf(span, sizeof(span), "job %.10s +%d", jobs[0].name, n - 1);
+	else
+		snprintf(span, sizeof(span), "job %.10s%s", jobs[0].name,
+			jobs[0].status == JOB_FAILED ? " (failed)" :
+			jobs[0].status == JOB_VERIFIED ? " (verified)" : "");
+	trace_add(w->trace, "job", span, atol(jobs[0].name), started, -1);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct job_list l = { NULL, 0 };
+	struct worker *w = arg;
+	long long started = trace_now();
+	struct job *jobs;
+	double reserved;
+	int i, n;
+
+	jobs = malloc(sizeof(*jobs) * MAX_GROUP);
+	if (!jobs)
+		return NULL;
+	while (claim_job(&l, &jobs[0], &reserved, 1)) {
+		n = claim_group(&l, jobs, &reserved);
+		if (w->trace) {
+			trace_add(w->trace, "queue", "claim", -1, started, -1);
+			started = trace_now();
+		}
+		render_group(w, jobs, n);
+		release_job(reserved);
+		for (i = 0; i < n; i++)
+			finish_job(w, &jobs[i]);
+		trace_jobs(w, jobs, n, started);
+		started = trace_now();
+	}
+	if (w->trace)
+		trace_add(w->trace, "queue", "claim", -1, started, -1);
+	free(jobs);
+	free(l.name);
+	return NULL;
+}
+
+/*
+ * work --pipeline.  Each job goes through three stages: dry (claim it
+ * and render up to the reverb), wet (the reverb) and save (write and
+ * journal it).  Every thread takes the furthest along stage that has
+ * work for it, so that one job's reverb and save overlap the next
+ * one's layers without a fixed split of threads between stages.  The
+ * queues between stages hold at most one job per thread, and a stage
+ * is only started when there is room for its result, which bounds the
+ * number of jobs in memory whatever the mix of jobs.  The state below
+ * is guarded by sched_mutex, and changes are signalled on sched_cond.
+ * Each stage is traced as a span of its job on the thread that ran it.
+ */
+struct stage_job {
+	struct job job;
+	int node;		/* where its buffers are, with --pin */
+	struct explosion_def e;
+	struct explodomatica_partial p;
+	struct sound *s;	/* the result, for the save stage */
+	double reserved;	/* memory */
+	double seconds;		/* spent rendering */
+};
+
+struct job_queue {
+	struct stage_job **job;
+	int head, n, size;
+	int running;		/* stages working towards a place in it */
+};
+
+static struct job_queue wet_queue, save_queue;
+static struct job_list pipeline_todo = { NULL, 0 };
+static int pipeline_wanted = 0;
+static int pipeline_jobs = 0;	/* claimed and not yet finished */
+static int pipeline_claiming = 0;
+static int pipeline_exhausted = 0;
+static int pipeline_failed = 0;	/* gave up with jobs left in todo/ */
+
+static int init_job_queue(struct job_queue *q, int size)
+{
+	q->job = malloc(sizeof(*q->job) * size);
+	q->head = q->n = q->running = 0;
+	q->size = size;
+	return q->job ? 0 : -1;
+}
+
+static int job_queue_room(struct job_queue *q)
+{
+	return q->n + q->running < q->size;
+}
+
+static void push_job(struct job_queue *q, struct stage_job *j)
+{
+	q->job[(q->head + q->n++) % q->size] = j;
+}
+
+/* The oldest job in q whose buffers are on node (-1: any), or NULL.
+ * Keeping a job on one node keeps its stages off remote memory.
+ */
+static struct stage_job *pop_job(struct job_queue *q, int node)
+{
+	struct stage_job *j = NULL;
+	int i;
+
+	for (i = 0; i < q->n; i++) {
+		j = q->job[(q->head + i) % q->size];
+		if (node < 0 || j->node == node)
+			break;
+	}
+	if (i == q->n)
+		return NULL;
+	for (; i > 0; i--)
+		q->job[(q->head + i) % q->size] = q->job[(q->head + i - 1) % q->size];
+	q->head = (q->head + 1) % q->size;
+	q->n--;
+	return j;
+}
+
+static void dry_stage(struct worker *w, struct stage_job *j)
+{
+	prepare_job(w, &j->job, &j->e);
+	if (j->job.status != JOB_RENDERING)
+		return;
+	j->seconds = now();
+	if (explodomatica_dry(&j->e, &j->p) != 0)
+		j->job.status = JOB_FAILED;
+	j->seconds = now() - j->seconds;
+}
+
+static void wet_stage(struct worker *w, struct stage_job *j)
+{
+	double started = now();
+
+	if (j->job.status != JOB_RENDERING)
+		return;
+	j->e.hook_arg = w;	/* the stage hooks are this thread's now */
+	j->s = explodomatica_wet(&j->e, &j->p);
+	if (!j->s)
+		j->job.status = JOB_FAILED;
+	j->seconds += now() - started;
+}
+
+static void save_stage(struct worker *w, struct stage_job *j)
+{
+	struct job *job = &j->job;
+
+	if (job->status == JOB_RENDERING) {
+		j->e.hook_arg = w;
+		save_job(&j->e, 0, j->s, &job);
+		commit_job(job, &j->e, j->seconds);
+	}
+	release_job(j->reserved);
+	finish_job(w, job);
+}
+
+static void *pipeline_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct stage_job *j;
+	unsigned long releases;
+	long long started;
+	int claimed;
+
+	pthread_mutex_lock(&sched_mutex);
+	while (1) {
+		j = pop_job(&save_queue, w->node);
+		if (j) {
+			pthread_mutex_unlock(&sched_mutex);
+			started = trace_now();
+			save_stage(w, j);
+			trace_jobs(w, &j->job, 1, started);
+			free(j);
+			pthread_mutex_lock(&sched_mutex);
+			pipeline_jobs--;
+			pthread_cond_broadcast(&sched_cond);
+			continue;
+		}
+		j = job_queue_room(&save_queue) ? pop_job(&wet_queue, w->node) : NULL;
+		if (j) {
+			save_queue.running++;
+			pthread_mutex_unlock(&sched_mutex);
+			started = trace_now();
+			wet_stage(w, j);
+			trace_jobs(w, &j->job, 1, started);
+			pthread_mutex_lock(&sched_mutex);
+			save_queue.running--;
+			push_job(&save_queue, j);
+			pthread_cond_broadcast(&sched_cond);
+			continue;
+		}
+		if (!pipeline_exhausted && !pipeline_claiming && job_queue_room(&wet_queue)) {
+			/* one thread claims at a time, as they share pipeline_todo */
+			pipeline_claiming = 1;
+			releases = memory_releases;
+			pthread_mutex_unlock(&sched_mutex);
+			j = calloc(1, sizeof(*j));
+			claimed = j ? claim_job(&pipeline_todo, &j->job, &j->reserved, 0) : -1;
+			pthread_mutex_lock(&sched_mutex);
+			pipeline_claiming = 0;
+			if (claimed > 0) {
+				j->node = w->node;
+				pipeline_jobs++;
+				wet_queue.running++;
+				pthread_mutex_unlock(&sched_mutex);
+				started = trace_now();
+				dry_stage(w, j);
+				trace_jobs(w, &j->job, 1, started);
+				pthread_mutex_lock(&sched_mutex);
+				wet_queue.running--;
+				push_job(&wet_queue, j);
+				pthread_cond_broadcast(&sched_cond);
+				continue;
+			}
+			if (!j && !pipeline_jobs) {
+				/* no job in flight will free the memory it needs */
+				fprintf(stderr, "explodomatica_batch: out of memory\n");
+				pipeline_failed = 1;
+				claimed = 0;
+			}
+			free(j);
+			if (claimed == 0)
+				pipeline_exhausted = 1;
+			/* else there is work, but not the memory for it (or for
+			 * its stage_job) until a job is saved */
+			if (claimed == 0 || memory_releases != releases) {
+				pthread_cond_broadcast(&sched_cond);
+				continue;
+			}
+		}
+		if (pipeline_exhausted && !pipeline_jobs)
+			break;
+		pthread_cond_wait(&sched_cond, &sched_mutex);
+	}
+	pthread_mutex_unlock(&sched_mutex);
+	return NULL;
+}
+
+/* Read a list of CPUs like "0-3,8-11" from path into set */
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+	char list[4096], *p;
+	int first, last, n, rc;
+
+	CPU_ZERO(set);
+	rc = read_job(path, list, sizeof(list));
+	if (rc != 0)
+		return rc;
+	for (p = list; *p; p += n) {
+		if (sscanf(p, "%d-%d%n", &first, &last, &n) != 2) {
+			if (sscanf(p, "%d%n", &first, &n) != 1)
+				break;
+			last = first;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (p[n] == ',')
+			n++;
+	}
+	return 0;
+}
+
+static int compare_places(const void *a, const void *b)
+{
+	const struct cpu_place *pa = a, *pb = b;
+
+	if (pa->smt != pb->smt)
+		return pa->smt - pb->smt;
+	if (pa->rank != pb->rank)
+		return pa->rank - pb->rank;
+	return pa->node - pb->node;
+}
+
+/* Fill in places[] from sysfs.  Without NUMA information every CPU is
+ * on node 0, and without SMT information every CPU is its own core.
+ */
+static int read_topology(void)
+{
+	char path[PATH_MAX];
+	cpu_set_t allowed, cpus;
+	int node_of[CPU_SETSIZE] = { 0 };
+	int cpu, i, node;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return -1;
+	places = calloc(CPU_COUNT(&allowed), sizeof(*places));
+	if (!places)
+		return -1;
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (read_cpulist(path, &cpus) != 0)
+			continue;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &cpus))
+				node_of[cpu] = node;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		places[nplaces].cpu = cpu;
+		places[nplaces].node = node_of[cpu];
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		if (read_cpulist(path, &cpus) == 0)
+			for (i = 0; i < cpu; i++)
+				if (CPU_ISSET(i, &cpus))
+					places[nplaces].smt++;
+		nplaces++;
+	}
+	for (cpu = 0; cpu < nplaces; cpu++)
+		for (i = 0; i < cpu; i++)
+			if (places[i].node == places[cpu].node && places[i].smt == places[cpu].smt)
+				places[cpu].rank++;
+	qsort(places, nplaces, sizeof(*places), compare_places);
+	return 0;
+}
+
+static void *pinned_thread(void *arg)
+{
+	struct worker *w = arg;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "explodomatica_batch: cannot pin a worker to CPU %d\n", w->cpu);
+	return pipeline_wanted ? pipeline_thread(arg) : worker_thread(arg);
+}
+
+static int work(int njobs)
+{
+	char host[64];
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	pthread_t *threads, heartbeat;
+	struct worker *workers;
+	struct trace *traces = NULL;
+	long rendered = 0, verified = 0;
+	int i;
+
+	if (gethostname(host, sizeof(host)) != 0)
+		strcpy(host, "unknown");
+	host[sizeof(host) - 1] = '\0';
+	explodomatica_quiet(1);
+
+	snprintf(worker_id, sizeof(worker_id), "%s.%d", host, (int) getpid());
+
+	threads = malloc(sizeof(*threads) * njobs);
+	workers = calloc(njobs, sizeof(*workers));
+	if (trace_wanted)
+		traces = calloc(njobs, sizeof(*traces));
+	if (!threads || !workers || (trace_wanted && !traces))
+		return 1;
+	if (pipeline_wanted && (init_job_queue(&wet_queue, njobs) != 0 ||
+			init_job_queue(&save_queue, njobs) != 0))
+		return 1;
+	if (pin_wanted) {
+		if (read_topology() != 0 || !nplaces) {
+			fprintf(stderr, "explodomatica_batch: cannot read the CPU topology\n");
+			return 1;
+		}
+		/*
+		 * Nothing more is needed for the buffers: the library writes
+		 * every buffer as it allocates it, so its pages come from the
+		 * node of the thread that allocates it, and malloc() gives each
+		 * thread its own arena, so what a thread frees it gets back.
+		 */
+	}
+	if (pthread_create(&heartbeat, NULL, heartbeat_thread, NULL) != 0) {
+		fprintf(stderr, "explodomatica_batch: cannot start threads\n");
+		return 1;
+	}
+	for (i = 0; i < njobs; i++) {
+		workers[i].trace = traces ? &traces[i] : NULL;
+		workers[i].cpu = pin_wanted ? places[i % nplaces].cpu : -1;
+		workers[i].node = pin_wanted ? places[i % nplaces].node : -1;
+		if (pthread_create(&threads[i], NULL,
+				pin_wanted ? pinned_thread :
+				pipeline_wanted ? pipeline_thread : worker_thread,
+				&workers[i]) != 0) {
+			fprintf(stderr, "explodomatica_batch: cannot start threads\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < njobs; i++) {
+		pthread_join(threads[i], NULL);
+		rendered += workers[i].rendered;
+		verified += workers[i].verified;
+	}
+	pthread_mutex_lock(&held_mutex);
+	heartbeat_stop = 1;
+	pthread_cond_signal(&heartbeat_cond);
+	pthread_mutex_unlock(&held_mutex);
+	pthread_join(heartbeat, NULL);
+	if (traces) {
+		queue_path(path, "trace", NULL);
+		mkdir(path, 0777);
+		snprintf(name, sizeof(name), "%s.json", worker_id);
+		queue_path(path, "trace", name);
+		if (trace_write(path, worker_id, getpid(), traces, njobs) != 0)
+			fprintf(stderr, "explodomatica_batch: cannot write %s\n", path);
+	}
+	printf("%s: rendered %ld jobs", worker_id, rendered);
+	if (verified)
+		printf(", %ld already finished", verified);
+	printf("\n");
+	return pipeline_failed;
+}
+
+static int count_dir(const char *subdir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	int n = 0;
+	DIR *d;
+
+	queue_path(path, subdir, NULL);
+	d = opendir(path);
+	if (!d)
+		return -1;
+	while ((de = readdir(d)))
+		if (de->d_name[0] != '.' && !strstr(de->d_name, ".tmp"))
+			n++;
+	closedir(d);
+	return n;
+}
+
+static int status(void)
+{
+	int todo = count_dir("todo"), claimed = count_dir("claimed");
+	int done = count_dir("done"), failed = count_dir("failed");
+	int merged = count_dir("merged");
+
+	if (todo < 0 || claimed < 0 || done < 0 || failed < 0) {
+		fprintf(stderr, "explodomatica_batch: '%s' is not a work queue\n", queue_dir);
+		return 1;
+	}
+	printf("todo %d  claimed %d  done %d  failed %d", todo, claimed, done, failed);
+	if (merged > 0)
+		printf("  merged %d", merged);
+	printf("\n");
+
+	load_journal();
+	if (journal_loaded) {
+		double seconds = 0.0;
+		int i, entries = 0;
+
+		for (i = 0; i < journal_size; i++) {
+			if (!journal[i].job_hash)
+				continue;
+			entries++;
+			seconds += journal[i].seconds;
+		}
+		printf("journal: %d jobs, %.1f seconds of rendering\n", entries, seconds);
+	}
+	return 0;
+}
+
+/* Check every job in done/ against the journal and requeue the ones
+ * whose output is missing or doesn't match.  Jobs in merged/ are
+ * finished, their outputs elsewhere, and are left alone.
+ */
+static int verify(void)
+{
+	char path[PATH_MAX], out[PATH_MAX], todo[PATH_MAX], line[MAX_JOB_LINE];
+	struct explosion_def e = explodomatica_defaults;
+	int nverified = 0, nrequeued = 0;
+	unsigned int job_hash;
+	struct dirent *de;
+	char *output;
+	DIR *d;
+
+	queue_path(path, "done", NULL);
+	d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "explodomatica_batch: '%s' is not a work queue\n", queue_dir);
+		return 1;
+	}
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		queue_path(path, "done", de->d_name);
+		if (read_job(path, line, sizeof(line)) != 0)
+			continue;
+		job_hash = hash_string(line);
+		if (parse_job(line, &output, &e) == 0) {
+			queue_path(out, "out", output);
+			if (output_verified(de->d_name, job_hash, out)) {
+				nverified++;
+				continue;
+			}
+		}
+		queue_path(todo, "todo", de->d_name);
+		if (rename(path, todo) != 0) {
+			fprintf(stderr, "explodomatica_batch: %s: %s\n", path, strerror(errno));
+			continue;
+		}
+		nrequeued++;
+	}
+	closedir(d);
+	if (count_dir("merged") > 0)
+		printf("%d merged, ", count_dir("merged"));
+	printf("%d jobs verified, %d requeued\n", nverified, nrequeued);
+	return nrequeued ? 2 : 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Concatenate the events in queuedir/trace/ *.json, which trace_write()
+ * puts one to a line.
+ */
+static int merge_traces(char *filename)
+{
+	char path[PATH_MAX], line[1024];
+	struct dirent *de;
+	int first = 1, len;
+	FILE *in, *out;
+	DIR *d;
+
+	queue_path(path, "trace", NULL);
+	d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "explodomatica_batch: no traces in '%s'\n", queue_dir);
+		return 1;
+	}
+	out = fopen(filename, "w");
+	if (!out) {
+		fprintf(stderr, "explodomatica_batch: %s: %s\n", filename, strerror(errno));
+		closedir(d);
+		return 1;
+	}
+	fprintf(out, "{\"traceEvents\": [");
+	while ((de = readdir(d))) {
+		len = strlen(de->d_name);
+		if (de->d_name[0] == '.' || len < 5 || strcmp(de->d_name + len - 5, ".json") != 0)
+			continue;
+		queue_path(path, "trace", de->d_name);
+		in = fopen(path, "r");
+		if (!in)
+			continue;
+		while (fgets(line, sizeof(line), in)) {
+			if (strncmp(line, "{\"name\":", 8) != 0)
+				continue;
+			len = strcspn(line, "\n");
+			if (len && line[len - 1] == ',')
+				len--;
+			fprintf(out, "%s\n%.*s", first ? "" : ",", len, line);
+			first = 0;
+		}
+		fclose(in);
+	}
+	closedir(d);
+	fprintf(out, "\n]}\n");
+	if (fclose(out) != 0) {
+		fprintf(stderr, "explodomatica_batch: %s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int merge(char *destdir)
+{
+	char path[PATH_MAX], src[PATH_MAX], dest[PATH_MAX];
+	char line[MAX_JOB_LINE], params[MAX_JOB_LINE], *output;
+	char **names = NULL;
+	struct dirent *de;
+	int n = 0, allocated = 0, i, moved = 0, rc = 0;
+	FILE *index;
+	DIR *d;
+
+	queue_path(path, "done", NULL);
+	d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "explodomatica_batch: '%s' is not a work queue\n", queue_dir);
+		return 1;
+	}
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (n == allocated) {
+			allocated = allocated ? allocated * 2 : 256;
+			names = realloc(names, sizeof(*names) * allocated);
+		}
+		names[n++] = strdup(de->d_name);
+	}
+	closedir(d);
+	qsort(names, n, sizeof(*names), compare_names);
+
+	queue_path(path, "merged", NULL);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "explodomatica_batch: cannot make %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/index.txt", destdir);
+	if (mkdir(destdir, 0777) < 0 && errno != EEXIST)
+		goto fail;
+	index = fopen(path, "a");
+	if (!index)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		queue_path(path, "done", names[i]);
+		if (read_job(path, line, sizeof(line)) != 0)
+			continue;
+		output = line;
+		strcpy(params, line + strcspn(line, " \t"));
+		line[strcspn(line, " \t")] = '\0';
+		queue_path(src, "out", output);
+		if (snprintf(dest, sizeof(dest), "%s/%s", destdir, output) >= (int) sizeof(dest)) {
+			fprintf(stderr, "explodomatica_batch: %s/%s: name too long\n",
+				destdir, output);
+			rc = 1;
+			continue;
+		}
+		if (access(src, F_OK) != 0) {
+			/* moved by a merge cut short before the job was */
+			if (access(dest, F_OK) != 0)
+				continue;
+		} else {
+			if (make_parent_dirs(dest) != 0 || rename(src, dest) != 0) {
+				fprintf(stderr, "explodomatica_batch: cannot move %s to %s: %s\n",
+					src, dest, strerror(errno));
+				rc = 1;
+				continue;
+			}
+			fprintf(index, "%s%s\n", output, params);
+			fflush(index);
+			moved++;
+		}
+		queue_path(src, "merged", names[i]);
+		if (rename(path, src) != 0) {
+			fprintf(stderr, "explodomatica_batch: cannot move %s to %s: %s\n",
+				path, src, strerror(errno));
+			rc = 1;
+		}
+	}
+	fclose(index);
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+
+	printf("merged %d outputs into %s\n", moved, destdir);
+	if (count_dir("todo") > 0 || count_dir("claimed") > 0 || count_dir("failed") > 0) {
+		printf("warning: the queue is not finished: ");
+		status();
+		rc = 1;
+	}
+	return rc;
+
+fail:
+	fprintf(stderr, "explodomatica_batch: cannot write to '%s': %s\n",
+		destdir, strerror(errno));
+	return 1;
+}
+
+/* 512M, 2G, ...; returns -1 if it doesn't parse */
+static double parse_size(const char *arg)
+{
+	double size;
+	char unit = '\0', extra;
+	int n;
+
+	n = sscanf(arg, "%lg%c%c", &size, &unit, &extra);
+	if (n < 1 || n > 2)
+		return -1.0;
+	switch (unit) {
+	case 'G': case 'g':
+		size *= 1024.0;
+		/* fall through */
+	case 'M': case 'm':
+		size *= 1024.0;
+		/* fall through */
+	case 'K': case 'k':
+		size *= 1024.0;
+		/* fall through */
+	case '\0':
+		return size;
+	default:
+		return -1.0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"jobs", 1, 0, 0},
+		{"reclaim", 1, 0, 1},
+		{"trace", 0, 0, 2},
+		{"memory", 1, 0, 3},
+		{"pipeline", 0, 0, 4},
+		{"pin", 0, 0, 5},
+		{0, 0, 0, 0}
+	};
+	int option_index = 0;
+	int c, njobs;
+	char *command;
+
+	njobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (njobs < 1)
+		njobs = 1;
+
+	while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0:
+			if (sscanf(optarg, "%d", &njobs) != 1 || njobs < 1)
+				usage();
+			break;
+		case 1:
+			if (sscanf(optarg, "%d", &reclaim_secs) != 1 || reclaim_secs < 1)
+				usage();
+			break;
+		case 2:
+			trace_wanted = 1;
+			break;
+		case 3:
+			memory_limit = parse_size(optarg);
+			if (memory_limit <= 0.0)
+				usage();
+			break;
+		case 4:
+			pipeline_wanted = 1;
+			break;
+		case 5:
+			pin_wanted = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2)
+		usage();
+	command = argv[optind];
+	queue_dir = argv[optind + 1];
+
+	if (strcmp(command, "init") == 0 && argc - optind == 3)
+		return init_queue(argv[optind + 2]);
+	if (strcmp(command, "work") == 0 && argc - optind == 2)
+		return work(njobs);
+	if (strcmp(command, "status") == 0 && argc - optind == 2)
+		return status();
+	if (strcmp(command, "verify") == 0 && argc - optind == 2)
+		return verify();
+	if (strcmp(command, "merge") == 0 && argc - optind == 3)
+		return merge(argv[optind + 2]);
+	if (strcmp(command, "trace") == 0 && argc - optind == 3)
+		return merge_traces(argv[optind + 2]);
+	usage();
+	return 1;
+}
@@ -0,0 +1,576 @@
+
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/* explodomatica_loadgen: measures render throughput and latency.
+ *
+ * Requests are either replayed from a manifest (one request per line,
+ * as space separated name=value pairs) or sampled uniformly within the
+ * ranges of gexplodomatica's sliders.  They are rendered in-process by
+ * the library, or sent to explodomaticad.
+ *
+ * With --rate, requests are started on a fixed schedule whether or not
+ * earlier ones have finished, and latency is measured from when each
+ * was due to start, so a backlog shows up in the numbers instead of
+ * quietly lowering the offered load.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#include "explodomatica.h"
+#include "slider_specs.h"
+#include "chrome_trace.h"
+
+#define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define MAX_REQUEST 1024
+#define MAX_MANIFEST_LINES 100000
+
+static struct range {
+	double lo, hi;
+} ranges[ARRAYSIZE(sliderspeclist)];
+
+static char **manifest = NULL;
+static int nmanifest = 0;
+
+static char *socket_path = NULL;
+static int want_fd = 0;
+static char *priority = NULL;
+static unsigned int nseeds = 0;
+static double rate = 0.0;
+static int concurrency = 0;
+static int nrequests = 100;
+static unsigned int sample_seed;
+static char *trace_file = NULL;
+
+static pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int next_request = 0;
+static double start_time;
+static double *latency;		/* per request, seconds, < 0 on error */
+
+static void usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "explodomatica_loadgen [options]\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --socket path   Send requests to explodomaticad listening on path,\n");
+	fprintf(stderr, "                  instead of rendering in this process\n");
+	fprintf(stderr, "  --fd            Ask the daemon for shared memory delivery\n");
+	fprintf(stderr, "  --priority p    Daemon priority class, interactive or bulk\n");
+	fprintf(stderr, "  --manifest file Replay the requests in file, one per line\n");
+	fprintf(stderr, "                  of name=value pairs, over and over\n");
+	fprintf(stderr, "  --param name=lo:hi\n");
+	fprintf(stderr, "                  Sample the named slider parameter from [lo, hi]\n");
+	fprintf(stderr, "                  instead of the slider's whole range\n");
+	fprintf(stderr, "  --seeds n       Draw seeds from 1..n, so requests repeat.\n");
+	fprintf(stderr, "                  Default is a new seed every request\n");
+	fprintf(stderr, "  --rate r        Start r requests per second.  Default is to start\n");
+	fprintf(stderr, "                  each as soon as there is room\n");
+	fprintf(stderr, "  --concurrency n Maximum requests in flight.  Default is the number of CPUs\n");
+	fprintf(stderr, "  --requests n    Number of requests.  Default is %d\n", nrequests);
+	fprintf(stderr, "  --random-seed n Seed for sampling parameters\n");
+	fprintf(stderr, "  --trace file    Write a timeline of every request (and, when rendering\n");
+	fprintf(stderr, "                  in this process, every stage) to file, in Chrome's\n");
+	fprintf(stderr, "                  trace event format\n");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+	double d = t - now();
+
+	if (d <= 0.0)
+		return;
+	ts.tv_sec = (time_t) d;
+	ts.tv_nsec = (long) ((d - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void read_manifest(char *filename)
+{
+	FILE *f;
+	char line[MAX_REQUEST], *p;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "explodomatica_loadgen: cannot open '%s': %s\n",
+			filename, strerror(errno));
+		exit(1);
+	}
+	manifest = malloc(sizeof(*manifest) * MAX_MANIFEST_LINES);
+	while (nmanifest < MAX_MANIFEST_LINES && fgets(line, sizeof(line), f)) {
+		p = strchr(line, '\n');
+		if (p)
+			*p = '\0';
+		p = line + strspn(line, " \t");
+		if (*p == '\0' || *p == '#')
+			continue;
+		manifest[nmanifest++] = strdup(p);
+	}
+	fclose(f);
+	if (nmanifest == 0) {
+		fprintf(stderr, "explodomatica_loadgen: '%s' has no requests\n", filename);
+		exit(1);
+	}
+}
+
+static void set_range(char *arg)
+{
+	char name[100];
+	double lo, hi;
+	unsigned int i;
+
+	if (sscanf(arg, "%99[^=]=%lg:%lg", name, &lo, &hi) != 3 || lo > hi)
+		usage();
+	for (i = 0; i < ARRAYSIZE(sliderspeclist); i++) {
+		if (strcmp(sliderspeclist[i].param, name) == 0) {
+			ranges[i].lo = lo;
+			ranges[i].hi = hi;
+			return;
+		}
+	}
+	fprintf(stderr, "explodomatica_loadgen: no slider for '%s'\n", name);
+	exit(1);
+}
+
+/* Request n, as name=value pairs */
+static void make_request(int n, char *buf, int buflen)
+{
+	unsigned int i, state, seed;
+	struct slider_spec *s;
+	double v;
+	int len;
+
+	state = sample_seed + n * 2654435761u;
+	if (manifest) {
+		len = snprintf(buf, buflen, "%s", manifest[n % nmanifest]);
+		if (strstr(buf, "seed="))
+			return;
+	} else {
+		len = 0;
+		for (i = 0; i < ARRAYSIZE(sliderspeclist); i++) {
+			s = &sliderspeclist[i];
+			v = ranges[i].lo + (ranges[i].hi - ranges[i].lo) *
+				((double) rand_r(&state) / (double) RAND_MAX);
+			/* land on a value the slider could actually be set to */
+			v = s->r1 + floor((v - s->r1) / s->inc + 0.5) * s->inc;
+			if (v < ranges[i].lo)
+				v += s->inc;
+			if (v > ranges[i].hi)
+				v -= s->inc;
+			if (s->inc >= 1.0)
+				len += snprintf(buf + len, buflen - len, "%s=%d ",
+						s->param, (int) floor(v + 0.5));
+			else
+				len += snprintf(buf + len, buflen - len, "%s=%g ", s->param, v);
+		}
+	}
+	if (nseeds)
+		seed = 1 + rand_r(&state) % nseeds;
+	else
+		seed = sample_seed + n + 1;
+	if (seed == 0)
+		seed = 1;
+	snprintf(buf + len, buflen - len, "%sseed=%u", len ? " " : "", seed);
+}
+
+static void trace_hook(struct explosion_def *e, enum explodomatica_stage stage,
+		int done, int nsamples)
+{
+	trace_stage(e->hook_arg, e, stage, done, nsamples);
+}
+
+static int render_in_process(char *request, int n, struct trace *trace)
+{
+	struct explosion_def e = EXPLOSION_DEF_DEFAULTS;
+	char *word, *value, *saveptr;
+	struct sound *s;
+
+	for (word = strtok_r(request, " \t", &saveptr); word;
+			word = strtok_r(NULL, " \t", &saveptr)) {
+		value = strchr(word, '=');
+		if (!value)
+			return -1;
+		*value++ = '\0';
+		if (explodomatica_set_param(&e, word, value) != 0)
+			return -1;
+	}
+	e.job_id = n;
+	if (trace) {
+		e.stage_hook = trace_hook;
+		e.hook_arg = trace;
+	}
+	s = explodomatica(&e);
+	if (!s)
+		return -1;
+	free_sound(s);
+	free(s);
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read the reply header, and the fd that may come with it */
+static int read_header(int fd, char *buf, int buflen, int *passed_fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int len = 0;
+	ssize_t n;
+
+	*passed_fd = -1;
+	while (len < buflen - 1) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf + len;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		n = recvmsg(fd, &msg, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+		if (buf[len] == '\n')
+			break;
+		len++;
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+/* Read every word of a result, as a client using it would, so that both
+ * delivery modes pay for bringing it into memory.
+ */
+static uint64_t result_checksum;
+
+static void checksum_result(const void *data, size_t len)
+{
+	const uint64_t *word = data;
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*word); i++)
+		sum ^= word[i];
+	__atomic_fetch_xor(&result_checksum, sum, __ATOMIC_RELAXED);
+}
+
+static int render_by_daemon(char *request)
+{
+	struct sockaddr_un addr;
+	char line[MAX_REQUEST + 100], header[100];
+	int fd, passed_fd, nsamples, rc = -1;
+	size_t len;
+	void *data;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto out;
+
+	snprintf(line, sizeof(line), "render %s%s%s%s\n", request,
+		priority ? " priority=" : "", priority ? priority : "",
+		want_fd ? " delivery=fd" : "");
+	len = strlen(line);
+	if (write(fd, line, len) != (ssize_t) len)
+		goto out;
+	if (read_header(fd, header, sizeof(header), &passed_fd) != 0 ||
+		sscanf(header, "ok %d", &nsamples) != 1)
+		goto out;
+
+	len = sizeof(double) * nsamples;
+	if (passed_fd >= 0) {
+		data = mmap(NULL, len, PROT_READ, MAP_SHARED, passed_fd, 0);
+		close(passed_fd);
+		if (data == MAP_FAILED)
+			goto out;
+		checksum_result(data, len);
+		munmap(data, len);
+	} else {
+		data = malloc(len);
+		if (!data || read_all(fd, data, len) != 0) {
+			free(data);
+			goto out;
+		}
+		checksum_result(data, len);
+		free(data);
+	}
+	rc = 0;
+out:
+	close(fd);
+	return rc;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct trace *trace = arg;
+	char request[MAX_REQUEST], span[32];
+	long long started;
+	double due;
+	int n, rc;
+
+	while (1) {
+		pthread_mutex_lock(&next_mutex);
+		n = next_request++;
+		pthread_mutex_unlock(&next_mutex);
+		if (n >= nrequests)
+			break;
+
+		make_request(n, request, sizeof(request));
+		if (rate > 0.0) {
+			due = start_time + n / rate;
+			sleep_until(due);
+		} else {
+			due = now();
+		}
+		started = trace_now();
+		if (socket_path)
+			rc = render_by_daemon(request);
+		else
+			rc = render_in_process(request, n, trace);
+		latency[n] = rc == 0 ? now() - due : -1.0;
+		if (trace) {
+			snprintf(span, sizeof(span), "request %d%s", n, rc ? " (failed)" : "");
+			trace_add(trace, "request", span, n, started, -1);
+		}
+	}
+	return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, int n, double p)
+{
+	int i = (int) ceil(p / 100.0 * n) - 1;
+
+	if (i < 0)
+		i = 0;
+	return sorted[i];
+}
+
+static void report(double elapsed)
+{
+	double *ok, sum = 0.0, bucket;
+	int i, nok = 0, count, maxcount, bar;
+
+	ok = malloc(sizeof(*ok) * nrequests);
+	for (i = 0; i < nrequests; i++) {
+		if (latency[i] >= 0.0) {
+			ok[nok++] = latency[i];
+			sum += latency[i];
+		}
+	}
+	printf("requests:    %d (%d ok, %d failed)\n", nrequests, nok, nrequests - nok);
+	printf("elapsed:     %.3f s\n", elapsed);
+	printf("throughput:  %.3f renders/s\n", nok / elapsed);
+	if (nok == 0) {
+		free(ok);
+		return;
+	}
+	qsort(ok, nok, sizeof(*ok), compare_doubles);
+	printf("latency (s): min %.4f  mean %.4f  p50 %.4f  p90 %.4f\n",
+		ok[0], sum / nok, percentile(ok, nok, 50.0), percentile(ok, nok, 90.0));
+	printf("             p99 %.4f  p99.9 %.4f  max %.4f\n",
+		percentile(ok, nok, 99.0), percentile(ok, nok, 99.9), ok[nok - 1]);
+
+	/* powers of two from 1ms up */
+	maxcount = 0;
+	for (i = 0, bucket = 0.001; i < nok; bucket *= 2.0) {
+		for (count = 0; i < nok && ok[i] <= bucket; i++)
+			count++;
+		if (count > maxcount)
+			maxcount = count;
+	}
+	printf("latency histogram:\n");
+	for (i = 0, bucket = 0.001; i < nok; bucket *= 2.0) {
+		for (count = 0; i < nok && ok[i] <= bucket; i++)
+			count++;
+		if (count == 0 && i == 0)
+			continue;
+		bar = (count * 50 + maxcount - 1) / maxcount;
+		printf("  <= %9.3f s %7d |%.*s\n", bucket, count, bar,
+			"##################################################");
+	}
+	free(ok);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"socket", 1, 0, 0},
+		{"fd", 0, 0, 1},
+		{"priority", 1, 0, 2},
+		{"manifest", 1, 0, 3},
+		{"param", 1, 0, 4},
+		{"seeds", 1, 0, 5},
+		{"rate", 1, 0, 6},
+		{"concurrency", 1, 0, 7},
+		{"requests", 1, 0, 8},
+		{"random-seed", 1, 0, 9},
+		{"trace", 1, 0, 10},
+		{0, 0, 0, 0}
+	};
+	int option_index = 0;
+	int c, i;
+	unsigned int j;
+	pthread_t *threads;
+	struct trace *traces = NULL;
+	double elapsed;
+
+	for (j = 0; j < ARRAYSIZE(sliderspeclist); j++) {
+		ranges[j].lo = sliderspeclist[j].r1;
+		ranges[j].hi = sliderspeclist[j].r2;
+	}
+	sample_seed = (unsigned int) time(NULL) ^ getpid();
+	concurrency = sysconf(_SC_NPROCESSORS_ONLN);
+	if (concurrency < 1)
+		concurrency = 1;
+
+	while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0:
+			socket_path = optarg;
+			break;
+		case 1:
+			want_fd = 1;
+			break;
+		case 2:
+			priority = optarg;
+			break;
+		case 3:
+			read_manifest(optarg);
+			break;
+		case 4:
+			set_range(optarg);
+			break;
+		case 5:
+			if (sscanf(optarg, "%u", &nseeds) != 1)
+				usage();
+			break;
+		case 6:
+			if (sscanf(optarg, "%lg", &rate) != 1 || rate < 0.0)
+				usage();
+			break;
+		case 7:
+			if (sscanf(optarg, "%d", &concurrency) != 1 || concurrency < 1)
+				usage();
+			break;
+		case 8:
+			if (sscanf(optarg, "%d", &nrequests) != 1 || nrequests < 1)
+				usage();
+			break;
+		case 9:
+			if (sscanf(optarg, "%u", &sample_seed) != 1)
+				usage();
+			break;
+		case 10:
+			trace_file = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		usage();
+
+	explodomatica_quiet(1);
+	latency = malloc(sizeof(*latency) * nrequests);
+	threads = malloc(sizeof(*threads) * concurrency);
+	if (trace_file)
+		traces = calloc(concurrency, sizeof(*traces));
+	if (!latency || !threads || (trace_file && !traces))
+		return 1;
+
+	start_time = now();
+	for (i = 0; i < concurrency; i++) {
+		if (pthread_create(&threads[i], NULL, worker_thread,
+				traces ? &traces[i] : NULL) != 0) {
+			fprintf(stderr, "explodomatica_loadgen: cannot start threads\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < concurrency; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start_time;
+
+	report(elapsed);
+	if (traces && trace_write(trace_file, "explodomatica_loadgen", getpid(),
+			traces, concurrency) != 0) {
+		fprintf(stderr, "explodomatica_loadgen: cannot write %s\n", trace_file);
+		return 1;
+	}
+	return 0;
+}
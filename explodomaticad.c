@@ -0,0 +1,1003 @@
+
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/* explodomaticad: renders explosions for clients on a unix domain socket.
+ *
+ * A client connects and sends a single line:
+ *
+ *	render name=value name=value ...\n
+ *
+ * where the names are those accepted by explodomatica_set_param(), and
+ * unmentioned parameters keep their defaults.  The reply is
+ *
+ *	ok <nsamples>\n
+ *
+ * followed by nsamples native doubles (44100Hz mono), or
+ *
+ *	error <reason>\n
+ *
+ * A client that asks for delivery=fd instead gets
+ *
+ *	ok <nsamples> fd\n
+ *
+ * with a file descriptor attached (SCM_RIGHTS), which it can mmap to
+ * read the samples without copying.  The descriptor refers to a sealed
+ * memfd shared by every client that got the same render, so it is
+ * read only.  If the daemon can't share a render that way, the samples
+ * follow inline as usual.
+ *
+ * Requests are keyed by their canonical parameters plus seed.  While a
+ * render is in flight, identical requests wait for it and share its
+ * result instead of reaching the workers.  Requests without a seed get a
+ * fresh one and are never coalesced.
+ *
+ * Two more names are understood besides the render parameters:
+ *
+ *	priority=interactive|bulk	(default interactive)
+ *	client=<name>			(default is the peer's pid)
+ *
+ * Queued interactive renders always go before bulk ones, and within a
+ * class clients take turns, so one client's thousand-job batch doesn't
+ * starve another's.  When interactive work is waiting and no worker is
+ * free, a running bulk render is cancelled and put back at the head of
+ * its client's queue.  It has a fixed seed, so the restarted render
+ * produces the same result.
+ *
+ * Sending "metrics\n" instead of a render request returns the daemon's
+ * counters and histograms in Prometheus text format.  With
+ * --metrics-file they are also written to a file periodically.
+ */
+#define _GNU_SOURCE	/* struct ucred */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "explodomatica.h"
+
+#define DEFAULT_SOCKET "/tmp/explodomaticad.socket"
+#define MAX_REQUEST 4096
+#define MAX_KEY 1024
+#define INFLIGHT_BUCKETS 256
+#define MAX_CLIENT_NAME 64
+#define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+enum priority {
+	PRIO_INTERACTIVE,	/* someone is waiting to hear it */
+	PRIO_BULK,		/* batch work, may be preempted */
+	NPRIOS,
+};
+
+struct render {
+	char key[MAX_KEY];
+	char client[MAX_CLIENT_NAME];
+	struct explosion_def e;
+	enum priority prio;
+	int coalesce;		/* in the inflight table */
+	int done;
+	int refcount;		/* waiting clients, plus the queue/worker */
+	volatile int cancel;	/* being preempted */
+	unsigned long dispatched;	/* when it was last given to a worker */
+	const double *data;	/* the result, once done; NULL if it failed */
+	int nsamples;
+	int memfd;		/* holds data, or -1 if s does */
+	struct sound *s;
+	pthread_cond_t done_cond;
+	struct client_queue *queue;	/* NULL unless queued */
+	struct render *next_inflight;
+	struct render *next_queued;
+};
+
+/* The queued renders of one client in one priority class */
+struct client_queue {
+	char name[MAX_CLIENT_NAME];
+	struct render *head, *tail;
+	struct client_queue *next;
+};
+
+static struct render *inflight[INFLIGHT_BUCKETS];
+
+/* Per class, the clients with queued renders, in the order they will be
+ * served.  A client that is served moves to the back.
+ */
+static struct client_queue *clients[NPRIOS];
+static int nqueued[NPRIOS];
+
+static struct render **running;	/* per worker, NULL when idle */
+static int nworkers;
+static int nidle = 0;
+static int npreempting = 0;
+static unsigned long dispatch_count = 0;
+static unsigned long render_count = 0;	/* job ids, for tracing */
+
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int seed_state;
+
+static const char *priority_name[] = { "interactive", "bulk" };
+
+/* Upper bounds of the latency histogram buckets, in seconds */
+static const double latency_buckets[] = {
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 120.0,
+};
+#define NBUCKETS ARRAYSIZE(latency_buckets)
+
+struct histogram {
+	unsigned long bucket[NBUCKETS];	/* observations <= latency_buckets[i] */
+	unsigned long count;
+	double sum;
+};
+
+/* Protected by render_mutex */
+static struct metrics {
+	unsigned long requests[NPRIOS];
+	unsigned long coalesced;	/* joined a render already in flight */
+	unsigned long bad_requests;
+	unsigned long renders;
+	unsigned long render_failures;
+	unsigned long cancellations;
+	unsigned long result_bytes;	/* held by finished renders */
+	struct histogram request_seconds[NPRIOS];
+	struct histogram render_seconds;
+	struct histogram stage_seconds[EXPLODOMATICA_NSTAGES];
+} metrics;
+
+static __thread double stage_started;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void observe(struct histogram *h, double seconds)
+{
+	unsigned int i;
+
+	for (i = 0; i < NBUCKETS; i++)
+		if (seconds <= latency_buckets[i])
+			h->bucket[i]++;
+	h->count++;
+	h->sum += seconds;
+}
+
+static void stage_hook(__attribute__((unused)) struct explosion_def *e,
+		enum explodomatica_stage stage, int done,
+		__attribute__((unused)) int nsamples)
+{
+	double t = now();
+
+	if (!done) {
+		stage_started = t;
+		return;
+	}
+	pthread_mutex_lock(&render_mutex);
+	observe(&metrics.stage_seconds[stage], t - stage_started);
+	pthread_mutex_unlock(&render_mutex);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "explodomaticad [options]\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --socket path   Listen on the given unix domain socket\n");
+	fprintf(stderr, "                  Default is %s\n", DEFAULT_SOCKET);
+	fprintf(stderr, "  --workers n     Number of render threads\n");
+	fprintf(stderr, "                  Default is the number of CPUs\n");
+	fprintf(stderr, "  --metrics-file path\n");
+	fprintf(stderr, "                  Periodically write metrics to the given file\n");
+	fprintf(stderr, "                  in Prometheus text format\n");
+	fprintf(stderr, "  --metrics-interval n\n");
+	fprintf(stderr, "                  Seconds between metrics file updates.  Default is 15\n");
+	exit(1);
+}
+
+/* FNV-1a */
+static unsigned int hash_key(const char *key)
+{
+	unsigned int h = 2166136261u;
+
+	while (*key) {
+		h ^= (unsigned char) *key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void unlink_inflight(struct render *r)
+{
+	struct render **p;
+
+	p = &inflight[hash_key(r->key) % INFLIGHT_BUCKETS];
+	for (; *p; p = &(*p)->next_inflight) {
+		if (*p == r) {
+			*p = r->next_inflight;
+			break;
+		}
+	}
+	r->coalesce = 0;
+}
+
+/* Called with render_mutex held */
+static void release_render(struct render *r)
+{
+	if (--r->refcount > 0)
+		return;
+	if (r->data)
+		metrics.result_bytes -= sizeof(r->data[0]) * r->nsamples;
+	if (r->memfd >= 0) {
+		munmap((void *) r->data, sizeof(r->data[0]) * r->nsamples);
+		close(r->memfd);
+	}
+	if (r->s) {
+		free_sound(r->s);
+		free(r->s);
+	}
+	pthread_cond_destroy(&r->done_cond);
+	free(r);
+}
+
+/* Queue r for its client, at the back, or at the front when it is being
+ * resumed after preemption.  Called with render_mutex held.
+ */
+static void enqueue_render(struct render *r, int front)
+{
+	struct client_queue *q, **p;
+
+	for (p = &clients[r->prio]; *p; p = &(*p)->next)
+		if (strcmp((*p)->name, r->client) == 0)
+			break;
+	q = *p;
+	if (!q) {
+		q = calloc(1, sizeof(*q));
+		if (!q)
+			abort();
+		strcpy(q->name, r->client);
+		*p = q;
+	}
+	if (front) {
+		r->next_queued = q->head;
+		q->head = r;
+		if (!q->tail)
+			q->tail = r;
+	} else {
+		r->next_queued = NULL;
+		if (q->tail)
+			q->tail->next_queued = r;
+		else
+			q->head = r;
+		q->tail = r;
+	}
+	r->queue = q;
+	nqueued[r->prio]++;
+	pthread_cond_signal(&work_cond);
+}
+
+static void remove_client_queue(enum priority prio, struct client_queue *q)
+{
+	struct client_queue **p;
+
+	for (p = &clients[prio]; *p; p = &(*p)->next) {
+		if (*p == q) {
+			*p = q->next;
+			break;
+		}
+	}
+	free(q);
+}
+
+/* Take a queued r out of its client's queue.  Called with render_mutex held. */
+static void unqueue_render(struct render *r)
+{
+	struct client_queue *q = r->queue;
+	struct render **p;
+
+	for (p = &q->head; *p; p = &(*p)->next_queued) {
+		if (*p == r) {
+			*p = r->next_queued;
+			break;
+		}
+	}
+	if (q->tail == r) {
+		q->tail = q->head;
+		while (q->tail && q->tail->next_queued)
+			q->tail = q->tail->next_queued;
+	}
+	r->queue = NULL;
+	r->next_queued = NULL;
+	nqueued[r->prio]--;
+	if (!q->head)
+		remove_client_queue(r->prio, q);
+}
+
+/* The render a free worker should do next: the first client in the
+ * highest nonempty class gives up its oldest render and goes to the back
+ * of the line.  Called with render_mutex held.
+ */
+static struct render *next_render(void)
+{
+	struct client_queue *q, **p;
+	struct render *r;
+	int prio;
+
+	for (prio = 0; prio < NPRIOS; prio++) {
+		q = clients[prio];
+		if (!q)
+			continue;
+		r = q->head;
+		if (r->next_queued && q->next) {
+			clients[prio] = q->next;
+			for (p = &clients[prio]; *p; p = &(*p)->next)
+				;
+			*p = q;
+			q->next = NULL;
+		}
+		unqueue_render(r);
+		return r;
+	}
+	return NULL;
+}
+
+/* If interactive renders are waiting with no worker to take them, cancel
+ * the most recently started bulk renders to free some workers.  Called
+ * with render_mutex held.
+ */
+static void preempt_bulk_renders(void)
+{
+	struct render *victim;
+	int i;
+
+	while (nqueued[PRIO_INTERACTIVE] > nidle + npreempting) {
+		victim = NULL;
+		for (i = 0; i < nworkers; i++) {
+			if (!running[i] || running[i]->prio != PRIO_BULK ||
+				running[i]->cancel)
+				continue;
+			if (!victim || running[i]->dispatched > victim->dispatched)
+				victim = running[i];
+		}
+		if (!victim)
+			return;
+		victim->cancel = 1;
+		npreempting++;
+		metrics.cancellations++;
+	}
+}
+
+/* Find the in-flight render for *e, or queue a new one.  Either way the
+ * caller holds a reference.  Called with render_mutex held.
+ */
+static struct render *get_render(struct explosion_def *e, char *key, int coalesce,
+		enum priority prio, char *client)
+{
+	struct render *r;
+	unsigned int bucket = 0;
+
+	if (coalesce) {
+		bucket = hash_key(key) % INFLIGHT_BUCKETS;
+		for (r = inflight[bucket]; r; r = r->next_inflight) {
+			if (strcmp(r->key, key) != 0)
+				continue;
+			r->refcount++;
+			metrics.coalesced++;
+			/* a bulk render someone is now waiting on becomes interactive */
+			if (prio < r->prio) {
+				if (r->queue) {
+					unqueue_render(r);
+					r->prio = prio;
+					strcpy(r->client, client);
+					enqueue_render(r, 0);
+					preempt_bulk_renders();
+				} else {
+					r->prio = prio;
+				}
+			}
+			return r;
+		}
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	strcpy(r->key, key);
+	strcpy(r->client, client);
+	r->e = *e;
+	r->e.cancel = &r->cancel;
+	r->e.stage_hook = stage_hook;
+	r->e.job_id = ++render_count;
+	r->prio = prio;
+	r->memfd = -1;
+	r->refcount = 2;
+	pthread_cond_init(&r->done_cond, NULL);
+	if (coalesce) {
+		r->coalesce = 1;
+		r->next_inflight = inflight[bucket];
+		inflight[bucket] = r;
+	}
+	enqueue_render(r, 0);
+	preempt_bulk_renders();
+	return r;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy a finished render into a sealed memfd, and map it read only for
+ * clients that want the samples inline.  On success the memfd holds the
+ * only copy; otherwise the render keeps s.
+ */
+static void share_result(struct render *r, struct sound *s)
+{
+	size_t len = sizeof(s->data[0]) * s->nsamples;
+	void *p;
+	int fd;
+
+	r->nsamples = s->nsamples;
+	r->data = s->data;
+	r->memfd = -1;
+	r->s = s;
+	if (len == 0)
+		return;
+
+	fd = memfd_create("explosion", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return;
+	if (write_all(fd, s->data, len) != 0 ||
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	r->data = p;
+	r->memfd = fd;
+	r->s = NULL;
+	free_sound(s);
+	free(s);
+}
+
+static void *worker_thread(void *arg)
+{
+	int worker = (int) (intptr_t) arg;
+	struct render *r;
+	struct sound *s;
+	double started;
+
+	pthread_mutex_lock(&render_mutex);
+	while (1) {
+		nidle++;
+		while (!(r = next_render()))
+			pthread_cond_wait(&work_cond, &render_mutex);
+		nidle--;
+		r->dispatched = ++dispatch_count;
+		running[worker] = r;
+		pthread_mutex_unlock(&render_mutex);
+
+		started = now();
+		s = explodomatica(&r->e);
+		if (s)
+			share_result(r, s);
+
+		pthread_mutex_lock(&render_mutex);
+		running[worker] = NULL;
+		if (r->cancel) {
+			npreempting--;
+			r->cancel = 0;
+			if (!s) {
+				enqueue_render(r, 1);
+				continue;
+			}
+			/* finished before it noticed */
+		}
+		observe(&metrics.render_seconds, now() - started);
+		if (r->data) {
+			metrics.renders++;
+			metrics.result_bytes += sizeof(r->data[0]) * r->nsamples;
+		} else {
+			metrics.render_failures++;
+		}
+		r->done = 1;
+		/* later identical requests start a new render */
+		if (r->coalesce)
+			unlink_inflight(r);
+		pthread_cond_broadcast(&r->done_cond);
+		release_render(r);
+	}
+	return NULL;
+}
+
+static int read_request(int fd, char *buf, int buflen)
+{
+	int len = 0;
+	ssize_t n;
+
+	while (len < buflen - 1) {
+		n = read(fd, buf + len, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if (buf[len] == '\n')
+			break;
+		len++;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/* Send header with a file descriptor attached */
+static int send_fd(int fd, const char *header, int passfd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = (void *) header;
+	iov.iov_len = strlen(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+
+	while (sendmsg(fd, &msg, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+static void write_histogram(FILE *f, const char *name, const char *label,
+		const char *value, struct histogram *h)
+{
+	unsigned int i;
+	char labels[100];
+
+	labels[0] = '\0';
+	if (label)
+		snprintf(labels, sizeof(labels), "%s=\"%s\",", label, value);
+	for (i = 0; i < NBUCKETS; i++)
+		fprintf(f, "%s_bucket{%sle=\"%g\"} %lu\n", name, labels,
+			latency_buckets[i], h->bucket[i]);
+	fprintf(f, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, h->count);
+	if (label)
+		snprintf(labels, sizeof(labels), "{%s=\"%s\"}", label, value);
+	fprintf(f, "%s_sum%s %g\n", name, labels, h->sum);
+	fprintf(f, "%s_count%s %lu\n", name, labels, h->count);
+}
+
+static long resident_bytes(void)
+{
+	FILE *f;
+	long size, resident = 0;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void write_metrics(FILE *f)
+{
+	struct metrics m;
+	int queued[NPRIOS];
+	int i, busy, idle;
+
+	pthread_mutex_lock(&render_mutex);
+	m = metrics;
+	memcpy(queued, nqueued, sizeof(queued));
+	idle = nidle;
+	busy = 0;
+	for (i = 0; i < nworkers; i++)
+		if (running[i])
+			busy++;
+	pthread_mutex_unlock(&render_mutex);
+
+	fprintf(f, "# HELP explodomaticad_requests_total Render requests accepted.\n");
+	fprintf(f, "# TYPE explodomaticad_requests_total counter\n");
+	for (i = 0; i < NPRIOS; i++)
+		fprintf(f, "explodomaticad_requests_total{priority=\"%s\"} %lu\n",
+			priority_name[i], m.requests[i]);
+	fprintf(f, "# HELP explodomaticad_coalesced_requests_total Requests that shared a render already in flight.\n");
+	fprintf(f, "# TYPE explodomaticad_coalesced_requests_total counter\n");
+	fprintf(f, "explodomaticad_coalesced_requests_total %lu\n", m.coalesced);
+	fprintf(f, "# HELP explodomaticad_bad_requests_total Requests rejected as malformed.\n");
+	fprintf(f, "# TYPE explodomaticad_bad_requests_total counter\n");
+	fprintf(f, "explodomaticad_bad_requests_total %lu\n", m.bad_requests);
+	fprintf(f, "# HELP explodomaticad_renders_total Renders completed.\n");
+	fprintf(f, "# TYPE explodomaticad_renders_total counter\n");
+	fprintf(f, "explodomaticad_renders_total %lu\n", m.renders);
+	fprintf(f, "# HELP explodomaticad_render_failures_total Renders that produced nothing.\n");
+	fprintf(f, "# TYPE explodomaticad_render_failures_total counter\n");
+	fprintf(f, "explodomaticad_render_failures_total %lu\n", m.render_failures);
+	fprintf(f, "# HELP explodomaticad_cancellations_total Bulk renders preempted.\n");
+	fprintf(f, "# TYPE explodomaticad_cancellations_total counter\n");
+	fprintf(f, "explodomaticad_cancellations_total %lu\n", m.cancellations);
+	fprintf(f, "# HELP explodomaticad_queue_depth Renders waiting for a worker.\n");
+	fprintf(f, "# TYPE explodomaticad_queue_depth gauge\n");
+	for (i = 0; i < NPRIOS; i++)
+		fprintf(f, "explodomaticad_queue_depth{priority=\"%s\"} %d\n",
+			priority_name[i], queued[i]);
+	fprintf(f, "# HELP explodomaticad_workers Render threads by state.\n");
+	fprintf(f, "# TYPE explodomaticad_workers gauge\n");
+	fprintf(f, "explodomaticad_workers{state=\"busy\"} %d\n", busy);
+	fprintf(f, "explodomaticad_workers{state=\"idle\"} %d\n", idle);
+	fprintf(f, "# HELP explodomaticad_result_bytes Memory held by finished renders.\n");
+	fprintf(f, "# TYPE explodomaticad_result_bytes gauge\n");
+	fprintf(f, "explodomaticad_result_bytes %lu\n", m.result_bytes);
+	fprintf(f, "# HELP explodomaticad_resident_bytes Resident set size of the daemon.\n");
+	fprintf(f, "# TYPE explodomaticad_resident_bytes gauge\n");
+	fprintf(f, "explodomaticad_resident_bytes %ld\n", resident_bytes());
+
+	fprintf(f, "# HELP explodomaticad_request_seconds Time from request to reply.\n");
+	fprintf(f, "# TYPE explodomaticad_request_seconds histogram\n");
+	for (i = 0; i < NPRIOS; i++)
+		write_histogram(f, "explodomaticad_request_seconds", "priority",
+			priority_name[i], &m.request_seconds[i]);
+	fprintf(f, "# HELP explodomaticad_render_seconds Time a worker spent on one render.\n");
+	fprintf(f, "# TYPE explodomaticad_render_seconds histogram\n");
+	write_histogram(f, "explodomaticad_render_seconds", NULL, NULL, &m.render_seconds);
+	fprintf(f, "# HELP explodomaticad_stage_seconds Time spent in each stage of a render.\n");
+	fprintf(f, "# TYPE explodomaticad_stage_seconds histogram\n");
+	for (i = 0; i < EXPLODOMATICA_NSTAGES; i++)
+		write_histogram(f, "explodomaticad_stage_seconds", "stage",
+			explodomatica_stage_name(i), &m.stage_seconds[i]);
+}
+
+static void reply_metrics(int fd)
+{
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&text, &len);
+	if (!f)
+		return;
+	write_metrics(f);
+	fclose(f);
+	write_all(fd, text, len);
+	free(text);
+}
+
+struct metrics_file {
+	char *path;
+	int interval;
+};
+
+/* Rewrite the metrics file every so often, atomically */
+static void *metrics_thread(void *arg)
+{
+	struct metrics_file *m = arg;
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+	while (1) {
+		f = fopen(tmp, "w");
+		if (f) {
+			write_metrics(f);
+			if (fclose(f) == 0)
+				rename(tmp, m->path);
+		}
+		sleep(m->interval);
+	}
+	return NULL;
+}
+
+static int reply_error(int fd, const char *reason)
+{
+	char msg[200];
+
+	snprintf(msg, sizeof(msg), "error %s\n", reason);
+	return write_all(fd, msg, strlen(msg));
+}
+
+/* Fill in *e, *prio, client and *want_fd from "render name=value ..." */
+static int parse_request(char *request, struct explosion_def *e,
+		enum priority *prio, char *client, int *want_fd)
+{
+	char *word, *value, *saveptr;
+
+	word = strtok_r(request, " \t\r", &saveptr);
+	if (!word || strcmp(word, "render") != 0)
+		return -1;
+	while ((word = strtok_r(NULL, " \t\r", &saveptr))) {
+		value = strchr(word, '=');
+		if (!value)
+			return -1;
+		*value++ = '\0';
+		if (strcmp(word, "priority") == 0) {
+			if (strcmp(value, "interactive") == 0)
+				*prio = PRIO_INTERACTIVE;
+			else if (strcmp(value, "bulk") == 0)
+				*prio = PRIO_BULK;
+			else
+				return -1;
+		} else if (strcmp(word, "delivery") == 0) {
+			if (strcmp(value, "fd") == 0)
+				*want_fd = 1;
+			else if (strcmp(value, "inline") == 0)
+				*want_fd = 0;
+			else
+				return -1;
+		} else if (strcmp(word, "client") == 0) {
+			if (strlen(value) >= MAX_CLIENT_NAME)
+				return -1;
+			strcpy(client, value);
+		} else if (explodomatica_set_param(e, word, value) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Reject parameters that would crash the renderer or tie up a worker
+ * for absurdly long.  Limits are a little wider than gexplodomatica's
+ * sliders.
+ */
+static int sane_request(struct explosion_def *e)
+{
+	return e->duration > 0.0 && e->duration <= 60.0 &&
+		e->nlayers >= 1 && e->nlayers <= 10 &&
+		e->preexplosions >= 0 && e->preexplosions <= 10 &&
+		e->preexplosion_delay >= 0.0 && e->preexplosion_delay <= 10.0 &&
+		e->preexplosion_low_pass_factor >= 0.0 &&
+		e->preexplosion_low_pass_factor <= 1.0 &&
+		e->preexplosion_lp_iters >= 0 && e->preexplosion_lp_iters <= 100 &&
+		e->final_speed_factor >= 0.05 && e->final_speed_factor <= 20.0 &&
+		e->reverb_early_refls >= 0 && e->reverb_early_refls <= 1000 &&
+		e->reverb_late_refls >= 0 && e->reverb_late_refls <= 1000;
+}
+
+static void *client_thread(void *arg)
+{
+	int fd = (int) (intptr_t) arg;
+	char request[MAX_REQUEST], key[MAX_KEY], header[100];
+	char client[MAX_CLIENT_NAME];
+	struct explosion_def e = EXPLOSION_DEF_DEFAULTS;
+	enum priority prio = PRIO_INTERACTIVE;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct render *r;
+	int coalesce = 1, want_fd = 0;
+	double started;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+		snprintf(client, sizeof(client), "pid%d", (int) cred.pid);
+	else
+		strcpy(client, "unknown");
+
+	if (read_request(fd, request, sizeof(request)) < 0)
+		goto out;
+	if (strcmp(request, "metrics") == 0) {
+		reply_metrics(fd);
+		goto out;
+	}
+	started = now();
+	if (parse_request(request, &e, &prio, client, &want_fd) != 0 || !sane_request(&e)) {
+		pthread_mutex_lock(&render_mutex);
+		metrics.bad_requests++;
+		pthread_mutex_unlock(&render_mutex);
+		reply_error(fd, "bad request");
+		goto out;
+	}
+
+	pthread_mutex_lock(&render_mutex);
+	metrics.requests[prio]++;
+	if (e.seed == 0) {
+		coalesce = 0;
+		do {
+			e.seed = rand_r(&seed_state);
+		} while (e.seed == 0);
+	}
+	if (explodomatica_canonical_params(&e, key, sizeof(key)) < 0) {
+		pthread_mutex_unlock(&render_mutex);
+		reply_error(fd, "bad request");
+		goto out;
+	}
+	r = get_render(&e, key, coalesce, prio, client);
+	if (!r) {
+		pthread_mutex_unlock(&render_mutex);
+		reply_error(fd, "out of memory");
+		goto out;
+	}
+	while (!r->done)
+		pthread_cond_wait(&r->done_cond, &render_mutex);
+	pthread_mutex_unlock(&render_mutex);
+
+	/* the result is never modified once done, so it can be sent unlocked */
+	if (r->data && want_fd && r->memfd >= 0) {
+		snprintf(header, sizeof(header), "ok %d fd\n", r->nsamples);
+		send_fd(fd, header, r->memfd);
+	} else if (r->data) {
+		snprintf(header, sizeof(header), "ok %d\n", r->nsamples);
+		if (write_all(fd, header, strlen(header)) == 0)
+			write_all(fd, r->data, sizeof(r->data[0]) * r->nsamples);
+	} else {
+		reply_error(fd, "render failed");
+	}
+
+	pthread_mutex_lock(&render_mutex);
+	observe(&metrics.request_seconds[prio], now() - started);
+	release_render(r);
+	pthread_mutex_unlock(&render_mutex);
+out:
+	close(fd);
+	return NULL;
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "explodomaticad: socket path too long: %s\n", path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "explodomaticad: socket: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		listen(fd, 64) < 0) {
+		fprintf(stderr, "explodomaticad: cannot listen on '%s': %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"socket", 1, 0, 0},
+		{"workers", 1, 0, 1},
+		{"metrics-file", 1, 0, 2},
+		{"metrics-interval", 1, 0, 3},
+		{0, 0, 0, 0}
+	};
+	static struct metrics_file mf = { NULL, 15 };
+	char *socket_path = DEFAULT_SOCKET;
+	int option_index = 0;
+	int c, i, listen_fd, fd;
+	struct timeval tv;
+	pthread_attr_t attr;
+	pthread_t t;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+
+	while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0:
+			socket_path = optarg;
+			break;
+		case 1:
+			if (sscanf(optarg, "%d", &nworkers) != 1 || nworkers < 1)
+				usage();
+			break;
+		case 2:
+			mf.path = optarg;
+			break;
+		case 3:
+			if (sscanf(optarg, "%d", &mf.interval) != 1 || mf.interval < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	gettimeofday(&tv, NULL);
+	seed_state = tv.tv_sec ^ tv.tv_usec ^ getpid();
+	signal(SIGPIPE, SIG_IGN);
+	explodomatica_quiet(1);
+
+	listen_fd = listen_on(socket_path);
+	if (listen_fd < 0)
+		return 1;
+
+	running = calloc(nworkers, sizeof(*running));
+	if (!running)
+		return 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&t, &attr, worker_thread, (void *) (intptr_t) i) != 0) {
+			fprintf(stderr, "explodomaticad: cannot start workers\n");
+			return 1;
+		}
+	}
+	if (mf.path && pthread_create(&t, &attr, metrics_thread, &mf) != 0) {
+		fprintf(stderr, "explodomaticad: cannot start metrics thread\n");
+		return 1;
+	}
+
+	while (1) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "explodomaticad: accept: %s\n", strerror(errno));
+			continue;
+		}
+		if (pthread_create(&t, &attr, client_thread, (void *) (intptr_t) fd) != 0)
+			close(fd);
+	}
+	return 0;
+}
@@ -0,0 +1,260 @@
+/* 
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "explodomatica.h"
+#include "wwviaudio.h"
+
+#define DEFINE_EXPLOSION_POOL_GLOBALS 1
+#include "explosion_pool.h"
+
+/* how often the refill thread looks for variants that finished playing */
+#define POOL_POLL_MSECS 50
+
+enum variant_state {
+	VARIANT_EMPTY,		/* needs rendering */
+	VARIANT_RENDERING,	/* refill thread is working on it */
+	VARIANT_READY,		/* rendered, never played */
+	VARIANT_USED,		/* triggered, may still be playing */
+};
+
+struct variant {
+	enum variant_state state;
+	int clip;
+	unsigned long last_used;
+};
+
+static struct pool {
+	struct explosion_def e;
+	int nvariants;
+	struct variant *v;
+	unsigned int renders;	/* started, for the seed of the next one */
+} pool[EXPLOSION_POOL_MAX_PRESETS];
+
+static int npresets = 0;
+static unsigned long trigger_count = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t refill_thread;
+static int refill_running = 0;
+static int refill_stop = 0;
+
+static void lower_thread_priority(void)
+{
+#ifdef SYS_gettid
+	/* On linux, nice values are per thread */
+	setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 19);
+#endif
+}
+
+/* Find an empty variant, or a used one that has finished playing,
+ * and mark it as being rendered.  Called with pool_mutex held.
+ */
+static struct variant *find_variant_to_refill(struct explosion_def *e)
+{
+	int i, j;
+	struct variant *v;
+
+	for (i = 0; i < npresets; i++) {
+		for (j = 0; j < pool[i].nvariants; j++) {
+			v = &pool[i].v[j];
+			if (v->state == VARIANT_USED &&
+				!wwviaudio_clip_in_use(v->clip))
+				v->state = VARIANT_EMPTY;
+			if (v->state != VARIANT_EMPTY)
+				continue;
+			v->state = VARIANT_RENDERING;
+			*e = pool[i].e;
+			/* a fixed seed would make every variant the same */
+			if (e->seed) {
+				e->seed += pool[i].renders++;
+				if (!e->seed)
+					e->seed = pool[i].e.seed + pool[i].renders++;
+			}
+			return v;
+		}
+	}
+	return NULL;
+}
+
+static void *refill_thread_func(__attribute__((unused)) void *arg)
+{
+	struct explosion_def e;
+	struct variant *v;
+	struct sound *s;
+	struct timespec deadline;
+	struct timeval now;
+	int rc;
+
+	lower_thread_priority();
+
+	pthread_mutex_lock(&pool_mutex);
+	while (!refill_stop) {
+		v = find_variant_to_refill(&e);
+		if (!v) {
+			gettimeofday(&now, NULL);
+			deadline.tv_sec = now.tv_sec;
+			deadline.tv_nsec = now.tv_usec * 1000 + POOL_POLL_MSECS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&pool_cond, &pool_mutex, &deadline);
+			continue;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+
+		s = explodomatica(&e);
+		rc = -1;
+		if (s) {
+			rc = wwviaudio_use_double_clip(v->clip, s->data, s->nsamples);
+			free_sound(s);
+			free(s);
+		}
+
+		pthread_mutex_lock(&pool_mutex);
+		v->state = rc == 0 ? VARIANT_READY : VARIANT_EMPTY;
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+int explosion_pool_init(void)
+{
+	if (refill_running)
+		return 0;
+	refill_stop = 0;
+	if (pthread_create(&refill_thread, NULL, refill_thread_func, NULL) != 0)
+		return -1;
+	refill_running = 1;
+	return 0;
+}
+
+int explosion_pool_add_preset(struct explosion_def *e, int nvariants, int first_clip)
+{
+	struct pool *p;
+	int i;
+
+	if (nvariants <= 0 || first_clip < 0)
+		return -1;
+
+	pthread_mutex_lock(&pool_mutex);
+	if (npresets >= EXPLOSION_POOL_MAX_PRESETS) {
+		pthread_mutex_unlock(&pool_mutex);
+		return -1;
+	}
+	p = &pool[npresets];
+	p->v = malloc(sizeof(*p->v) * nvariants);
+	if (!p->v) {
+		pthread_mutex_unlock(&pool_mutex);
+		return -1;
+	}
+	p->e = *e;
+	strcpy(p->e.save_filename, "");	/* variants are never saved */
+	p->nvariants = nvariants;
+	p->renders = 0;
+	for (i = 0; i < nvariants; i++) {
+		p->v[i].state = VARIANT_EMPTY;
+		p->v[i].clip = first_clip + i;
+		p->v[i].last_used = 0;
+	}
+	npresets++;
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	return npresets - 1;
+}
+
+int explosion_pool_trigger(int preset)
+{
+	struct pool *p;
+	struct variant *v = NULL;
+	int i, channel;
+
+	if (preset < 0 || preset >= npresets)
+		return -1;
+	p = &pool[preset];
+
+	pthread_mutex_lock(&pool_mutex);
+	for (i = 0; i < p->nvariants; i++) {
+		if (p->v[i].state == VARIANT_READY) {
+			v = &p->v[i];
+			break;
+		}
+		/* fall back to repeating the least recently used variant */
+		if (p->v[i].state == VARIANT_USED &&
+			(!v || p->v[i].last_used < v->last_used))
+			v = &p->v[i];
+	}
+	if (!v) {
+		pthread_mutex_unlock(&pool_mutex);
+		return -1;
+	}
+	channel = wwviaudio_add_sound(v->clip);
+	v->state = VARIANT_USED;
+	v->last_used = ++trigger_count;
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	return channel;
+}
+
+int explosion_pool_ready(int preset)
+{
+	int i, count = 0;
+
+	if (preset < 0 || preset >= npresets)
+		return 0;
+	pthread_mutex_lock(&pool_mutex);
+	for (i = 0; i < pool[preset].nvariants; i++)
+		if (pool[preset].v[i].state == VARIANT_READY)
+			count++;
+	pthread_mutex_unlock(&pool_mutex);
+	return count;
+}
+
+void explosion_pool_shutdown(void)
+{
+	int i;
+
+	if (refill_running) {
+		pthread_mutex_lock(&pool_mutex);
+		refill_stop = 1;
+		pthread_cond_signal(&pool_cond);
+		pthread_mutex_unlock(&pool_mutex);
+		pthread_join(refill_thread, NULL);
+		refill_running = 0;
+	}
+	for (i = 0; i < npresets; i++) {
+		free(pool[i].v);
+		pool[i].v = NULL;
+	}
+	npresets = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef __EXPLOSION_POOL_H__
+#define __EXPLOSION_POOL_H__
+/* 
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifdef DEFINE_EXPLOSION_POOL_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+
+/* Pools of pre-rendered explosion variants, for games that want every
+ * explosion to sound different but can't afford to run explodomatica()
+ * when the explosion happens.
+ *
+ * Each preset owns a fixed number of wwviaudio clip numbers, one per
+ * variant, which bounds its memory.  Triggering plays a ready variant
+ * and marks it used; a single low priority background thread renders
+ * a fresh variant into each used clip once it has finished playing.
+ *
+ * Call wwviaudio_initialize_portaudio() first, with enough clips for
+ * all the pools.
+ */
+
+#define EXPLOSION_POOL_MAX_PRESETS 16
+
+/* Start the background refill thread.  0 on success, -1 otherwise. */
+GLOBAL int explosion_pool_init(void);
+
+/* Add a preset.  Variants are rendered from *e (which is copied) into
+ * clips first_clip .. first_clip + nvariants - 1.  If e->seed is set,
+ * the nth render uses e->seed + n, so variants differ but a run can be
+ * repeated.  Returns the preset number to pass to
+ * explosion_pool_trigger(), or -1 on error.
+ */
+GLOBAL int explosion_pool_add_preset(struct explosion_def *e,
+		int nvariants, int first_clip);
+
+/* Play an unused variant of the preset right away.  If every variant has
+ * been used and none has been refilled yet, the least recently used one
+ * is played again.  Returns the wwviaudio channel, or -1.
+ */
+GLOBAL int explosion_pool_trigger(int preset);
+
+/* Number of variants of the preset ready to be triggered. */
+GLOBAL int explosion_pool_ready(int preset);
+
+/* Stop the refill thread and forget all presets. */
+GLOBAL void explosion_pool_shutdown(void);
+
+#undef GLOBAL
+#endif
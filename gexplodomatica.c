@@ -21,52 +21,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <gtk/gtk.h>
 #include <pthread.h>
 
 #include "explodomatica.h"
 #include "wwviaudio.h"
+#include "slider_specs.h"
 
 static struct explosion_def explodomatica_defaults = EXPLOSION_DEF_DEFAULTS;
 static struct sound *generated_sound = NULL;
 
 #define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
 
-struct slider_spec {
-	char *labeltext;
-	double r1, r2, inc, initial_value;
-	char *tooltiptext;
-} sliderspeclist[] = {
-	{ "Layers:", 1.0, 6.0, 1.0, 4.0,
-			"Specifies number of sound layers to use to build up each explosion" },
-	{ "Duration (secs):", 0.2, 60.0, 0.05, 15.0,
-			"Specifies duration of explosion in seconds" },
-	{ "Pre-explosions:", 0.0, 5.0, 1.0, 1.0,
-			"Number of \"pre-explosions\" to use.  You can think of pre-explosions "
-			"as the \"ka-\" in \"ka-BOOM!\"" },
-	{ "Pre-delay:", 0.1, 3.0, 0.05, 0.20,
-			"Duration of \"pre-explosions\" in seconds before the \"main\" "
-			"explosion kicks in." },
-	{ "Pre-lp-factor:", 0.2, 0.9, 0.05, 0.8,
-			"Specifies the impact of the low pass filter used "
-			"on the pre-explosion part of the sound. Values "
-			"closer to zero lower the cutoff frequency "
-			"while values close to one raise the cutoff frequency. "
-			"Value should be between 0.2 and 0.9. "
-			"Default is 0.800000" },
-	{ "Pre-lp-count:", 0, 10, 1.0, 2.0,
-			"Specifies the number of times the low pass filter used "
-			"on the pre-explosion part of the sound." },
-	{ "Speed factor:", 0.1, 10.0, 0.05, 1.0,
-			"Amount to speed up (or slow down) the final "
-			"explosion sound. Values greater than 1.0 speed "
-			"the sound up, values less than 1.0 slow it down." },
-	{ "Reverb early refls:", 1.0, 50.0, 1.0, 5.0,
-			"Number of early reflections in reverb" },
-	{ "Reverb late refls:", 1.0, 1000.0, 1.0, 40.0,
-			"Number of late reflections in reverb" },
-};
-
 struct slider {
 	GtkWidget *label, *slider;
 	double r1, r2, inc;
@@ -92,7 +60,8 @@ struct button_spec {
 #define INPUTBUTTON 1
 	{ "Input", inputclicked, "Use wav file data as input instead of generating white noise as input."},
 #define PLAYBUTTON 2
-	{ "Play", playclicked, "Play the most recently generated sound."},
+	{ "Play", playclicked, "Play the most recently generated sound, "
+				"or as much of the sound being generated as is ready."},
 #define SAVEBUTTON 3
 	{ "Save", saveclicked, "Save the most recently generated sound."},
 #define CANCELBUTTON 4
@@ -117,13 +86,18 @@ struct gui {
 	GtkWidget *progress_bar;
 	volatile float progress;
 	struct explosion_def e;
-	struct explodomatica_thread_arg arg;
 	int ptimer;
 	pthread_t t;
 	int thread_done;
+	volatile int cancel;
+	volatile int frames_ready;	/* of the sound being generated */
+	int streaming;		/* it is going into a stream clip as it's made */
 	char input_file[PATH_MAX];
 };
 
+/* Frames handed to the audio at a time while generating, about 0.1s */
+#define STREAM_BLOCK 4096
+
 #if 0
 static gboolean delete_event(GtkWidget *widget, GdkEvent *event, gpointer data)
 {
@@ -137,14 +111,15 @@ static void quitclicked(__attribute__((unused)) GtkWidget *widget,
 	gtk_main_quit();
 }
 
-static void playclicked(__attribute__((unused)) GtkWidget *widget,
-		__attribute__((unused)) gpointer data)
+/* Clip 1 holds the sound, put there as it is generated */
+static void playclicked(__attribute__((unused)) GtkWidget *widget, gpointer data)
 {
-	if (!generated_sound) {
+	struct gui *ui = data;
+
+	if (!generated_sound && !ui->frames_ready) {
 		return;
 	}
 	wwviaudio_cancel_all_sounds();
-	wwviaudio_use_double_clip(1, generated_sound->data, generated_sound->nsamples);
 	wwviaudio_add_sound(1);
 }
 
@@ -154,11 +129,10 @@ static void cancelclicked(__attribute__((unused)) GtkWidget *widget,
 	struct gui *ui = data;
 	if (ui->thread_done)
 		return;
-	pthread_cancel(ui->t);
+	/* the generating thread stops soon after, see update_progress_bar() */
+	ui->cancel = 1;
 	ui->progress = 0.0;
-	generated_sound = 0;
-	gtk_widget_set_sensitive(ui->button[GENERATEBUTTON], 1);
-	gtk_widget_set_sensitive(ui->button[SAVEBUTTON], 0);
+	wwviaudio_cancel_all_sounds();
 	gtk_widget_set_sensitive(ui->button[PLAYBUTTON], 0);
 	gtk_widget_set_sensitive(ui->button[CANCELBUTTON], 0);
 }
@@ -196,11 +170,49 @@ static void data_ready(struct sound *s, void *x)
 	ui->thread_done = 1;
 }
 
+/* Called in the generating thread with each block of the sound as it is
+ * made, so that it can be played before it is finished.
+ */
+static void block_ready(__attribute__((unused)) struct explosion_def *e,
+		const double *block, int start, int nframes, int total, void *x)
+{
+	struct gui *ui = x;
+	int i;
+
+	if (start == 0) {
+		/* the last sound must have stopped before clip 1 is replaced */
+		for (i = 0; i < 1000 && wwviaudio_clip_in_use(1); i++)
+			usleep(1000);
+		ui->streaming = !wwviaudio_clip_in_use(1) &&
+				wwviaudio_begin_stream_clip(1, total) == 0;
+	}
+	if (ui->streaming && wwviaudio_append_stream_clip(1, block, nframes) == 0)
+		ui->frames_ready = start + nframes;
+}
+
+static void *generate_thread(void *x)
+{
+	struct gui *ui = x;
+	struct sound *s;
+
+	s = explodomatica_stream(&ui->e, STREAM_BLOCK, block_ready, ui);
+	if (ui->streaming)
+		wwviaudio_end_stream_clip(1, s ? s->nsamples : 0);
+	else if (s)
+		wwviaudio_use_double_clip(1, s->data, s->nsamples);
+	data_ready(s, ui);
+	return NULL;
+}
+
 static void generateclicked(__attribute__((unused)) GtkWidget *widget, gpointer data)
 {
 	struct gui *ui = data;
 
 	ui->progress = 0.0;
+	ui->cancel = 0;
+	ui->frames_ready = 0;
+	ui->streaming = 0;
+	wwviaudio_cancel_all_sounds();
 
 	/* disable save and play buttons while sound is generated */
 	gtk_widget_set_sensitive(ui->button[GENERATEBUTTON], 0);
@@ -231,14 +243,13 @@ static void generateclicked(__attribute__((unused)) GtkWidget *widget, gpointer
 	ui->e.reverb_early_refls = (int) gtk_range_get_value(GTK_RANGE(ui->sliderlist[REVERB_EARLY_REFLS].slider));
 	ui->e.reverb_late_refls = (int) gtk_range_get_value(GTK_RANGE(ui->sliderlist[REVERB_LATE_REFLS].slider));
 	ui->e.reverb = gtk_toggle_button_get_active((GtkToggleButton *) ui->reverbcheck);
+	ui->e.cancel = &ui->cancel;
 
 	if (generated_sound)
 		free_sound(generated_sound);
+	generated_sound = NULL;
 
-	ui->arg.e = &ui->e;
-	ui->arg.f = data_ready; 
-	ui->arg.arg = ui;
-	explodomatica_thread(&ui->t, &ui->arg);
+	pthread_create(&ui->t, NULL, generate_thread, ui);
 }
 
 static void add_slider(GtkWidget *container, int row,
@@ -303,11 +314,14 @@ static gint update_progress_bar(gpointer data)
 	if (ui->thread_done) {
 		/* enable save and play buttons after sound is generated */
 		gtk_widget_set_sensitive(ui->button[GENERATEBUTTON], 1);
-		gtk_widget_set_sensitive(ui->button[SAVEBUTTON], 1);
-		gtk_widget_set_sensitive(ui->button[PLAYBUTTON], 1);
+		gtk_widget_set_sensitive(ui->button[SAVEBUTTON], generated_sound != NULL);
+		gtk_widget_set_sensitive(ui->button[PLAYBUTTON], generated_sound != NULL);
 		gtk_widget_set_sensitive(ui->button[CANCELBUTTON], 0);
 		pthread_join(ui->t, NULL);
 		ui->thread_done = 0;
+	} else if (ui->frames_ready && !ui->cancel) {
+		/* the start of the sound can be played while the rest is made */
+		gtk_widget_set_sensitive(ui->button[PLAYBUTTON], 1);
 	}
 	return TRUE;
 }
@@ -341,6 +355,7 @@ static void init_ui(int *argc, char **argv[], struct gui *ui)
 	strcpy(ui->input_file, "");
 	ui->progress = 0.0;
 	ui->thread_done = 0;
+	ui->frames_ready = 0;
 	ui->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW (ui->window), "Explodomatica");
 
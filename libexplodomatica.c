@@ -30,25 +30,40 @@
 #include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <sndfile.h> /* libsndfile */
 
 #define DEFINE_EXPLODOMATICA_GLOBALS 1
 #include "explodomatica.h"
+#include "probes.h"
 	
 #define SAMPLERATE 44100
 #define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
 
 static volatile float *explodomatica_progress = NULL;
+static int explodomatica_quiet_flag = 0;
+
+/* Each rendering thread has its own random state, seeded from
+ * explosion_def.seed, so concurrent renders don't disturb one another
+ * and a given seed always makes the same explosion.
+ */
+static __thread unsigned int rng_state;
+
+static int rng(void)
+{
+	return rand_r(&rng_state);
+}
 
 static double drand(void)
 {
-	return (double) rand() / (double) RAND_MAX;
+	return (double) rng() / (double) RAND_MAX;
 }
 
 static int irand(int n)
 {
-	return (n * (rand() & 0x0ffff)) / 0x0ffff;
+	return (n * (rng() & 0x0ffff)) / 0x0ffff;
 }
 
 void free_sound(struct sound *s)
@@ -61,6 +76,17 @@ void free_sound(struct sound *s)
 	s->nsamples = 0;
 }
 
+static void destroy_sound(struct sound *s)
+{
+	free_sound(s);
+	free(s);
+}
+
+static int cancelled(struct explosion_def *e)
+{
+	return e->cancel && *e->cancel;
+}
+
 static struct sound *alloc_sound(int nsamples)
 {
 	struct sound *s;
@@ -96,7 +122,8 @@ int explodomatica_save_file(char *filename, struct sound *s, int channels)
 	}
 	sf_write_double(sf, s->data, s->nsamples);
 	sf_close(sf);
-	printf("Saved output in '%s'\n", filename);
+	if (!explodomatica_quiet_flag)
+		printf("Saved output in '%s'\n", filename);
 	return 0;
 }
 
@@ -269,7 +296,7 @@ static struct sound *change_speed(struct sound *s, double factor)
 	for (i = 1; i < nsamples; i++) {
 		sample_point = (double) i / (double) nsamples * (double) s->nsamples;
 		sp1 = (int) sample_point;
-		sp2 = sp1 + 1;
+		sp2 = sp1 + 1 < s->nsamples ? sp1 + 1 : sp1;
 		o->data[i] = interpolate(sample_point, (double) sp1, s->data[sp1], 
 						(double) sp2, s->data[sp2]);
 		o->nsamples++;
@@ -328,6 +355,8 @@ static void delay_effect_in_place(struct sound *s, int delay_samples)
 
 static void dot(void)
 {
+	if (explodomatica_quiet_flag)
+		return;
 	printf("."); fflush(stdout);
 }
 
@@ -340,8 +369,42 @@ static void update_progress(float progress_inc)
 		*explodomatica_progress = 0.0;
 }
 
-static struct sound *poor_mans_reverb(struct sound *s,
-	int early_refls, int late_refls)
+static void trim_trailing_silence(struct sound *s)
+{
+	int i;
+
+	for (i = s->nsamples -1 ; i >= 0; i--) {
+		if (fabs(s->data[i]) < 0.00001)
+			s->nsamples--;
+	}
+}
+
+/* Copies of the reverb as it stood after various numbers of late
+ * reflections, which is what a shorter reverb would have produced.
+ */
+struct reverb_snapshots {
+	int n;
+	const int *late_refls;	/* take copies[i] after late_refls[i] */
+	struct sound **copies;
+};
+
+static void take_snapshots(struct reverb_snapshots *snap, int late_refls,
+		struct sound *withverb)
+{
+	int i;
+
+	if (!snap)
+		return;
+	for (i = 0; i < snap->n; i++) {
+		if (snap->late_refls[i] != late_refls || snap->copies[i])
+			continue;
+		snap->copies[i] = copy_sound(withverb);
+		trim_trailing_silence(snap->copies[i]);
+	}
+}
+
+static struct sound *poor_mans_reverb(struct explosion_def *e, struct sound *s,
+	int early_refls, int late_refls, struct reverb_snapshots *snap)
 {
 	int i, delay;
 	struct sound *echo, *echo2;
@@ -349,8 +412,10 @@ static struct sound *poor_mans_reverb(struct sound *s,
 	double gain;
 	float progress_inc = 1.0 / (float) (early_refls + late_refls);
 
-	printf("Calculating poor man's reverb");
-	fflush(stdout);
+	if (!explodomatica_quiet_flag) {
+		printf("Calculating poor man's reverb");
+		fflush(stdout);
+	}
 	withverb = alloc_sound(s->nsamples * 2);
 	for (i = 0; i < s->nsamples; i++)
 		withverb->data[i] = s->data[i];
@@ -359,34 +424,51 @@ static struct sound *poor_mans_reverb(struct sound *s,
 	echo = copy_sound(withverb);
 
 	for (i = 0; i < early_refls; i++) {
+		if (cancelled(e))
+			goto cancelled;
 		dot();
 		echo2 = sliding_low_pass(echo, 0.5, 0.5);
 		gain = drand() * 0.03 + 0.03;
 		amplify_in_place(echo, gain); 
 
 		/* 300 ms range */
-		delay = (3 * 4410 * (rand() & 0x0ffff)) / 0x0ffff;
+		delay = (3 * 4410 * (rng() & 0x0ffff)) / 0x0ffff;
 		delay_effect_in_place(echo2, delay);
 		accumulate_sound(withverb, echo2);
 		free_sound(echo2);
+		PROBE3(explodomatica, reflection__done, e->job_id, i, delay);
 		update_progress(progress_inc);
 	}
 
+	take_snapshots(snap, 0, withverb);
 	for (i = 0; i < late_refls; i++) {
+		if (cancelled(e))
+			goto cancelled;
 		dot();
 		echo2 = sliding_low_pass(echo, 0.5, 0.2);
 		gain = drand() * 0.01 + 0.03;
 		amplify_in_place(echo, gain); 
 
 		/* 2000 ms range */
-		delay = (2 * 44100 * (rand() & 0x0ffff)) / 0x0ffff;
+		delay = (2 * 44100 * (rng() & 0x0ffff)) / 0x0ffff;
 		delay_effect_in_place(echo2, delay);
 		accumulate_sound(withverb, echo2);
 		free_sound(echo2);
+		PROBE3(explodomatica, reflection__done, e->job_id, early_refls + i, delay);
 		update_progress(progress_inc);
+		take_snapshots(snap, i + 1, withverb);
 	}
-	printf("done\n");
+	if (!explodomatica_quiet_flag)
+		printf("done\n");
+	destroy_sound(echo);
 	return withverb;
+
+cancelled:
+	if (!explodomatica_quiet_flag)
+		printf("cancelled\n");
+	destroy_sound(echo);
+	destroy_sound(withverb);
+	return NULL;
 }
 
 static struct sound *make_explosion(struct explosion_def *e, double seconds, int nlayers)
@@ -397,6 +479,11 @@ static struct sound *make_explosion(struct explosion_def *e, double seconds, int
 	int i, j, iters;
 
 	for (i = 0; i < nlayers; i++) {
+		if (cancelled(e)) {
+			for (j = 0; j < i; j++)
+				destroy_sound(s[j]);
+			return NULL;
+		}
 		t = make_noise(e, seconds_to_frames(seconds));
 
 		if (i > 0) 
@@ -419,6 +506,7 @@ static struct sound *make_explosion(struct explosion_def *e, double seconds, int
 			renormalize(t);
 		}
 		s[i] = t;
+		PROBE3(explodomatica, layer__done, e->job_id, i, t->nsamples);
 	}
 
 	for (i = 1; i < nlayers; i++) {
@@ -429,16 +517,6 @@ static struct sound *make_explosion(struct explosion_def *e, double seconds, int
 	return s[0];
 }
 
-static void trim_trailing_silence(struct sound *s)
-{
-	int i;
-
-	for (i = s->nsamples -1 ; i >= 0; i--) {
-		if (fabs(s->data[i]) < 0.00001)
-			s->nsamples--;
-	}
-}
-
 static struct sound *make_preexplosions(struct explosion_def *e)
 {
 	struct sound *pe;
@@ -453,6 +531,10 @@ static struct sound *make_preexplosions(struct explosion_def *e)
 		struct sound *exp;
 		int offset;
 		exp = make_explosion(e, e->duration / 2, e->nlayers);
+		if (!exp) {
+			destroy_sound(pe);
+			return NULL;
+		}
 		offset = irand(seconds_to_frames(e->preexplosion_delay));
 		delay_effect_in_place(exp, offset);
 		accumulate_sound(pe, exp);
@@ -511,45 +593,793 @@ static void read_input_file(char *filename,
 	sf_close(sf);	
 }
 
-struct sound *explodomatica(struct explosion_def *e)
+static void stage_begin(struct explosion_def *e, enum explodomatica_stage stage)
 {
-	struct sound *pe, *s, *s2;
+	PROBE2(explodomatica, stage__start, e->job_id, stage);
+	if (e->stage_hook)
+		e->stage_hook(e, stage, 0, 0);
+}
 
-	if (e->input_file && strcmp(e->input_file, "") != 0)
-		read_input_file(e->input_file, &e->input_data, &e->input_samples);
+static void stage_end_frames(struct explosion_def *e, enum explodomatica_stage stage,
+		int nsamples)
+{
+	PROBE3(explodomatica, stage__done, e->job_id, stage, nsamples);
+	if (e->stage_hook)
+		e->stage_hook(e, stage, 1, nsamples);
+}
+
+static void stage_end(struct explosion_def *e, enum explodomatica_stage stage,
+		struct sound *s)
+{
+	stage_end_frames(e, stage, s ? s->nsamples : 0);
+}
+
+const char *explodomatica_stage_name(enum explodomatica_stage stage)
+{
+	static const char *names[] = {
+		"preexplosions", "explosion", "mix", "speed", "reverb", "save",
+	};
+
+	if ((unsigned int) stage >= EXPLODOMATICA_NSTAGES)
+		return "unknown";
+	return names[stage];
+}
+
+/*
+ * The fixed point engine, used when explosion_def.fixed_point is set,
+ * for machines without fast floating point.  It follows the same steps
+ * as the code above, using the same random numbers, but samples are
+ * int32_t in Q27 (4 bits of headroom above full scale, for mixing) and
+ * filter coefficients and gains are Q30.  Products are done in 64 bits
+ * and rounded to nearest.  Only per-call coefficients are worked out
+ * from the double parameters; the per-sample work is all integer, until
+ * the result is converted to doubles at the very end.
+ */
+#define FX_SHIFT 27
+#define FX_ONE (1 << FX_SHIFT)
+#define FX_Q30(x) ((int32_t) ((x) * (double) (1 << 30) + 0.5))
+#define FX_SILENCE ((int32_t) (0.00001 * FX_ONE))
+
+struct fx_sound {
+	int32_t *data;
+	int nsamples;
+};
+
+static struct fx_sound *fx_alloc(int nsamples)
+{
+	struct fx_sound *s;
+
+	s = malloc(sizeof(*s));
+	s->data = calloc(nsamples ? nsamples : 1, sizeof(*s->data));
+	s->nsamples = nsamples;
+	return s;
+}
+
+static void fx_destroy(struct fx_sound *s)
+{
+	free(s->data);
+	free(s);
+}
+
+static struct fx_sound *fx_copy(struct fx_sound *s)
+{
+	struct fx_sound *o = fx_alloc(s->nsamples);
+
+	memcpy(o->data, s->data, sizeof(o->data[0]) * s->nsamples);
+	return o;
+}
+
+static int32_t fx_saturate(int64_t x)
+{
+	if (x > INT32_MAX)
+		return INT32_MAX;
+	if (x < -INT32_MAX)
+		return -INT32_MAX;
+	return (int32_t) x;
+}
+
+/* Q27 sample times Q30 coefficient */
+static int32_t fx_mul(int32_t x, int32_t q30)
+{
+	return fx_saturate(((int64_t) x * q30 + (1 << 29)) >> 30);
+}
+
+static void fx_accumulate(struct fx_sound *acc, struct fx_sound *inc)
+{
+	int i;
+
+	if (inc->nsamples > acc->nsamples) {
+		acc->data = realloc(acc->data, sizeof(acc->data[0]) * inc->nsamples);
+		memset(acc->data + acc->nsamples, 0,
+			sizeof(acc->data[0]) * (inc->nsamples - acc->nsamples));
+		acc->nsamples = inc->nsamples;
+	}
+	for (i = 0; i < inc->nsamples; i++)
+		acc->data[i] = fx_saturate((int64_t) acc->data[i] + inc->data[i]);
+}
+
+static void fx_amplify(struct fx_sound *s, int32_t gain)
+{
+	int i;
+
+	for (i = 0; i < s->nsamples; i++) {
+		s->data[i] = fx_mul(s->data[i], gain);
+		if (s->data[i] > FX_ONE)
+			s->data[i] = FX_ONE;
+		if (s->data[i] < -FX_ONE)
+			s->data[i] = -FX_ONE;
+	}
+}
+
+/* 0.03 .. 0.03 + range, from the next random number */
+static int32_t fx_random_gain(int32_t range)
+{
+	return FX_Q30(0.03) + (int32_t) (((int64_t) range * rng()) / RAND_MAX);
+}
+
+static struct fx_sound *fx_make_noise(struct explosion_def *e, int nsamples)
+{
+	struct fx_sound *s = fx_alloc(nsamples);
+	int64_t x;
+	int i, n;
+
+	if (e->input_data) {
+		n = nsamples;
+		if (e->input_samples < (unsigned long long) n)
+			n = e->input_samples;
+		for (i = 0; i < n; i++)
+			s->data[i] = (int32_t) (e->input_data[i] * FX_ONE);
+		return s;
+	}
+
+	/* (2.0 * drand() - 1.0) * 0.70 */
+	for (i = 0; i < nsamples; i++) {
+		x = (2 * (int64_t) rng() - RAND_MAX) * FX_Q30(0.70);
+#if RAND_MAX == 0x7fffffff
+		s->data[i] = (int32_t) ((x + ((int64_t) 1 << 33)) >> 34);
+#else
+		s->data[i] = (int32_t) ((x / RAND_MAX + (1 << 2)) >> 3);
+#endif
+	}
+	return s;
+}
+
+static void fx_fadeout(struct fx_sound *s)
+{
+	int64_t factor = (int64_t) 1 << 62, step;
+	int i;
+
+	if (!s->nsamples)
+		return;
+	step = factor / s->nsamples;
+	for (i = 0; i < s->nsamples; i++) {
+		s->data[i] = fx_mul(s->data[i], (int32_t) (factor >> 32));
+		factor -= step;
+	}
+}
+
+/* alpha slides from a1 to a2 (Q30) and is squared, as in sliding_low_pass() */
+static struct fx_sound *fx_sliding_low_pass(struct fx_sound *s, int32_t a1, int32_t a2)
+{
+	struct fx_sound *o = fx_alloc(s->nsamples);
+	int64_t lin, step;
+	int32_t alpha;
+	int i;
+
+	if (!s->nsamples)
+		return o;
+	step = ((int64_t) (a2 - a1) << 32) / s->nsamples;
+	lin = ((int64_t) a1 << 32) + step;
+	o->data[0] = s->data[0];
+	for (i = 1; i < s->nsamples; i++) {
+		alpha = (int32_t) (((lin >> 32) * (lin >> 32) + (1 << 29)) >> 30);
+		o->data[i] = fx_saturate(o->data[i - 1] +
+			((((int64_t) s->data[i] - o->data[i - 1]) * alpha + (1 << 29)) >> 30));
+		lin += step;
+	}
+	return o;
+}
+
+static void fx_sliding_low_pass_inplace(struct fx_sound *s, int32_t a1, int32_t a2)
+{
+	struct fx_sound *o = fx_sliding_low_pass(s, a1, a2);
+
+	free(s->data);
+	s->data = o->data;
+	free(o);
+}
+
+/* Linear interpolation, stepping through s in 32.32 fixed point */
+static void fx_change_speed_inplace(struct fx_sound *s, double factor)
+{
+	int nsamples = (int) (s->nsamples / factor);
+	struct fx_sound *o;
+	int64_t pos, step;
+	int32_t y1, y2;
+	int i, sp1;
+
+	o = fx_alloc(nsamples);
+	if (nsamples > 0 && s->nsamples > 0) {
+		step = ((int64_t) s->nsamples << 32) / nsamples;
+		o->data[0] = s->data[0];
+		for (i = 1, pos = step; i < nsamples; i++, pos += step) {
+			sp1 = (int) (pos >> 32);
+			y1 = s->data[sp1];
+			y2 = sp1 + 1 < s->nsamples ? s->data[sp1 + 1] : y1;
+			o->data[i] = y1 + (int32_t) ((((int64_t) y2 - y1) *
+				((pos & 0xffffffff) >> 2) + (1 << 29)) >> 30);
+		}
+	}
+	free(s->data);
+	s->data = o->data;
+	s->nsamples = o->nsamples;
+	free(o);
+}
+
+/* Scale so the peak is 1 / 1.05 of full scale, with one division */
+static void fx_renormalize(struct fx_sound *s)
+{
+	int32_t max = 0;
+	int64_t gain;
+	int i;
+
+	for (i = 0; i < s->nsamples; i++) {
+		if (s->data[i] > max)
+			max = s->data[i];
+		else if (-s->data[i] > max)
+			max = -s->data[i];
+	}
+	if (!max)
+		return;
+	gain = ((int64_t) (FX_ONE / 1.05) << 24) / max;
+	for (i = 0; i < s->nsamples; i++)
+		s->data[i] = (int32_t) ((s->data[i] * gain + (1 << 23)) >> 24);
+}
+
+static void fx_delay(struct fx_sound *s, int delay_samples)
+{
+	int i, source;
+
+	for (i = s->nsamples - 1; i >= 0; i--) {
+		source = i - delay_samples;
+		s->data[i] = source > 0 ? s->data[source] : 0;
+	}
+}
+
+static void fx_trim_trailing_silence(struct fx_sound *s)
+{
+	int i;
+
+	for (i = s->nsamples - 1; i >= 0; i--)
+		if (s->data[i] < FX_SILENCE && s->data[i] > -FX_SILENCE)
+			s->nsamples--;
+}
+
+static struct fx_sound *fx_reverb(struct explosion_def *e, struct fx_sound *s)
+{
+	int early_refls = e->reverb_early_refls, late_refls = e->reverb_late_refls;
+	float progress_inc = 1.0 / (float) (early_refls + late_refls);
+	struct fx_sound *withverb, *echo, *echo2;
+	int i, delay;
+
+	if (!explodomatica_quiet_flag) {
+		printf("Calculating poor man's reverb");
+		fflush(stdout);
+	}
+	withverb = fx_alloc(s->nsamples * 2);
+	memcpy(withverb->data, s->data, sizeof(s->data[0]) * s->nsamples);
+	dot();
+	echo = fx_copy(withverb);
+
+	for (i = 0; i < early_refls + late_refls; i++) {
+		if (cancelled(e)) {
+			if (!explodomatica_quiet_flag)
+				printf("cancelled\n");
+			fx_destroy(echo);
+			fx_destroy(withverb);
+			return NULL;
+		}
+		dot();
+		if (i < early_refls) {
+			echo2 = fx_sliding_low_pass(echo, FX_Q30(0.5), FX_Q30(0.5));
+			fx_amplify(echo, fx_random_gain(FX_Q30(0.03)));
+			delay = (3 * 4410 * (rng() & 0x0ffff)) / 0x0ffff;
+		} else {
+			echo2 = fx_sliding_low_pass(echo, FX_Q30(0.5), FX_Q30(0.2));
+			fx_amplify(echo, fx_random_gain(FX_Q30(0.01)));
+			delay = (2 * 44100 * (rng() & 0x0ffff)) / 0x0ffff;
+		}
+		fx_delay(echo2, delay);
+		fx_accumulate(withverb, echo2);
+		fx_destroy(echo2);
+		PROBE3(explodomatica, reflection__done, e->job_id, i, delay);
+		update_progress(progress_inc);
+	}
+	if (!explodomatica_quiet_flag)
+		printf("done\n");
+	fx_destroy(echo);
+	return withverb;
+}
+
+static struct fx_sound *fx_make_explosion(struct explosion_def *e, double seconds, int nlayers)
+{
+	struct fx_sound *s[10];
+	struct fx_sound *t;
+	int32_t a1, a2;
+	int i, j, iters;
+
+	for (i = 0; i < nlayers; i++) {
+		if (cancelled(e)) {
+			for (j = 0; j < i; j++)
+				fx_destroy(s[j]);
+			return NULL;
+		}
+		t = fx_make_noise(e, seconds_to_frames(seconds));
+		if (i > 0)
+			fx_change_speed_inplace(t, i * 2);
+
+		iters = i + 1;
+		if (iters > 3)
+			iters = 3;
+		for (j = 0; j < iters; j++)
+			fx_fadeout(t);
+
+		a1 = (int32_t) (((int64_t) (i + 1) << 30) / nlayers);
+		a2 = (int32_t) (((int64_t) i << 30) / nlayers);
+		iters = 3 - i;
+		if (iters < 0)
+			iters = 1;
+		for (j = 0; j < iters; j++) {
+			fx_sliding_low_pass_inplace(t, a1, a2);
+			fx_renormalize(t);
+		}
+		s[i] = t;
+		PROBE3(explodomatica, layer__done, e->job_id, i, t->nsamples);
+	}
+
+	for (i = 1; i < nlayers; i++) {
+		fx_accumulate(s[0], s[i]);
+		fx_destroy(s[i]);
+	}
+	fx_renormalize(s[0]);
+	return s[0];
+}
+
+static struct fx_sound *fx_make_preexplosions(struct explosion_def *e)
+{
+	int32_t factor = FX_Q30(e->preexplosion_low_pass_factor);
+	struct fx_sound *pe, *exp;
+	int i;
 
+	if (!e->preexplosions)
+		return NULL;
+
+	pe = fx_alloc(seconds_to_frames(e->duration));
+	for (i = 0; i < e->preexplosions; i++) {
+		exp = fx_make_explosion(e, e->duration / 2, e->nlayers);
+		if (!exp) {
+			fx_destroy(pe);
+			return NULL;
+		}
+		fx_delay(exp, irand(seconds_to_frames(e->preexplosion_delay)));
+		fx_accumulate(pe, exp);
+		fx_renormalize(pe);
+		fx_destroy(exp);
+	}
+	for (i = 0; i < e->preexplosion_lp_iters; i++)
+		fx_sliding_low_pass_inplace(pe, factor, factor);
+	fx_renormalize(pe);
+	return pe;
+}
+
+/* explodomatica() for fixed_point, minus the loading and saving */
+static struct sound *fx_render(struct explosion_def *e)
+{
+	struct fx_sound *pe, *s, *s2;
+	struct sound *out;
+	int i;
+
+	stage_begin(e, EXPLODOMATICA_STAGE_PREEXPLOSIONS);
+	pe = fx_make_preexplosions(e);
+	stage_end_frames(e, EXPLODOMATICA_STAGE_PREEXPLOSIONS, pe ? pe->nsamples : 0);
+	if (cancelled(e)) {
+		if (pe)
+			fx_destroy(pe);
+		return NULL;
+	}
+	if (!e->reverb && explodomatica_progress)
+		*explodomatica_progress = 0.33;
+
+	stage_begin(e, EXPLODOMATICA_STAGE_EXPLOSION);
+	s = fx_make_explosion(e, e->duration, e->nlayers);
+	stage_end_frames(e, EXPLODOMATICA_STAGE_EXPLOSION, s ? s->nsamples : 0);
+	if (!s) {
+		if (pe)
+			fx_destroy(pe);
+		return NULL;
+	}
+	if (!e->reverb && explodomatica_progress)
+		*explodomatica_progress = 0.5;
+
+	stage_begin(e, EXPLODOMATICA_STAGE_MIX);
+	if (pe) {
+		fx_accumulate(s, pe);
+		fx_renormalize(s);
+		fx_destroy(pe);
+	}
+	stage_end_frames(e, EXPLODOMATICA_STAGE_MIX, s->nsamples);
+	if (!e->reverb && explodomatica_progress)
+		*explodomatica_progress = 0.8;
+
+	stage_begin(e, EXPLODOMATICA_STAGE_SPEED);
+	fx_change_speed_inplace(s, e->final_speed_factor);
+	fx_trim_trailing_silence(s);
+	stage_end_frames(e, EXPLODOMATICA_STAGE_SPEED, s->nsamples);
+
+	if (e->reverb) {
+		stage_begin(e, EXPLODOMATICA_STAGE_REVERB);
+		s2 = fx_reverb(e, s);
+		if (s2)
+			fx_trim_trailing_silence(s2);
+		stage_end_frames(e, EXPLODOMATICA_STAGE_REVERB, s2 ? s2->nsamples : 0);
+		fx_destroy(s);
+		if (!s2)
+			return NULL;
+	} else {
+		s2 = s;
+		if (explodomatica_progress)
+			*explodomatica_progress = 0.9;
+	}
+
+	out = alloc_sound(s2->nsamples);
+	for (i = 0; i < s2->nsamples; i++)
+		out->data[i] = s2->data[i] * (1.0 / FX_ONE);
+	out->nsamples = s2->nsamples;
+	fx_destroy(s2);
+	return out;
+}
+
+/* Pre-explosions and the main explosion, mixed */
+static struct sound *render_mix(struct explosion_def *e)
+{
+	struct sound *pe, *s;
+
+	stage_begin(e, EXPLODOMATICA_STAGE_PREEXPLOSIONS);
 	pe = make_preexplosions(e);
+	stage_end(e, EXPLODOMATICA_STAGE_PREEXPLOSIONS, pe);
+	if (cancelled(e)) {
+		if (pe)
+			destroy_sound(pe);
+		return NULL;
+	}
 
 	if (!e->reverb && explodomatica_progress)
 		*explodomatica_progress = 0.33;	
 	
+	stage_begin(e, EXPLODOMATICA_STAGE_EXPLOSION);
 	s = make_explosion(e, e->duration, e->nlayers);
+	stage_end(e, EXPLODOMATICA_STAGE_EXPLOSION, s);
+	if (!s) {
+		if (pe)
+			destroy_sound(pe);
+		return NULL;
+	}
 	if (!e->reverb && explodomatica_progress)
 		*explodomatica_progress = 0.5;	
+	stage_begin(e, EXPLODOMATICA_STAGE_MIX);
 	if (pe) {
 		accumulate_sound(s, pe);
 		renormalize(s);
+		destroy_sound(pe);
 	}
+	stage_end(e, EXPLODOMATICA_STAGE_MIX, s);
 	if (!e->reverb && explodomatica_progress)
 		*explodomatica_progress = 0.8;	
+	return s;
+}
+
+static void render_speed(struct explosion_def *e, struct sound *s)
+{
+	stage_begin(e, EXPLODOMATICA_STAGE_SPEED);
 	change_speed_inplace(s, e->final_speed_factor);
 	trim_trailing_silence(s);
-	if (e->reverb) {
-		s2 = poor_mans_reverb(s, e->reverb_early_refls, e->reverb_late_refls);
+	stage_end(e, EXPLODOMATICA_STAGE_SPEED, s);
+}
+
+/* Returns a new sound, with reverb if wanted, leaving s alone */
+static struct sound *render_reverb(struct explosion_def *e, struct sound *s,
+		struct reverb_snapshots *snap)
+{
+	struct sound *s2;
+
+	if (!e->reverb) {
+		if (explodomatica_progress)
+			*explodomatica_progress = 0.9;	
+		return copy_sound(s);
+	}
+	stage_begin(e, EXPLODOMATICA_STAGE_REVERB);
+	s2 = poor_mans_reverb(e, s, e->reverb_early_refls, e->reverb_late_refls, snap);
+	if (s2)
 		trim_trailing_silence(s2);
+	stage_end(e, EXPLODOMATICA_STAGE_REVERB, s2);
+	return s2;
+}
+
+/*
+ * The reverb, a window of output frames at a time.  poor_mans_reverb()
+ * adds each reflection across the whole sound in turn.  Here each
+ * reflection is only filtered over the part of the sound that lands in
+ * the window after its delay.  Its filter forgets what came before
+ * after REVERB_WARMUP samples, so that is how far back it is started
+ * (or from 0, exactly as poor_mans_reverb() does).  Its echo is the dry
+ * sound times the product of the gains drawn before it, which is what
+ * amplifying the echo over and over comes to, so the output matches
+ * to within rounding.  A window which starts where the last one ended
+ * carries each filter on rather than warming it up again.
+ */
+#define REVERB_WARMUP 2048	/* 0.96^2048 is far below double precision */
+
+struct reflection {
+	int delay;
+	double scale;		/* of the dry sound in its echo */
+	double alpha1, alpha2;
+	int next;		/* the next filter output to compute, */
+	double last;		/* after this one */
+};
+
+struct reverb_cursor {
+	struct sound *dry;
+	int nsamples;		/* with reverb, twice the dry sound's */
+	int nrefls;
+	struct reflection *refl;
+};
+
+/* Draws the random numbers poor_mans_reverb() would, from rng_state */
+static int init_reverb_cursor(struct explosion_def *e, struct sound *dry,
+		struct reverb_cursor *c)
+{
+	struct reflection *r;
+	double scale = 1.0;
+	int i, early = e->reverb_early_refls > 0 ? e->reverb_early_refls : 0;
+	int late = e->reverb_late_refls > 0 ? e->reverb_late_refls : 0;
+
+	c->dry = dry;
+	c->nsamples = dry->nsamples * 2;
+	c->nrefls = early + late;
+	c->refl = malloc(sizeof(*c->refl) * (c->nrefls + 1));
+	if (!c->refl)
+		return -1;
+	for (i = 0; i < c->nrefls; i++) {
+		r = &c->refl[i];
+		r->scale = scale;
+		r->next = 0;
+		r->last = 0.0;
+		r->alpha1 = 0.5;
+		if (i < early) {
+			r->alpha2 = 0.5;
+			scale *= drand() * 0.03 + 0.03;
+			r->delay = (3 * 4410 * (rng() & 0x0ffff)) / 0x0ffff;
+		} else {
+			r->alpha2 = 0.2;
+			scale *= drand() * 0.01 + 0.03;
+			r->delay = (2 * 44100 * (rng() & 0x0ffff)) / 0x0ffff;
+		}
+	}
+	return 0;
+}
+
+/* The next output of r's filter, as sliding_low_pass() computes it */
+static double reflection_step(struct reverb_cursor *c, struct reflection *r)
+{
+	int j = r->next++;
+	double alpha, echo;
+
+	echo = j < c->dry->nsamples ? c->dry->data[j] * r->scale : 0.0;
+	if (j == 0)
+		return r->last = echo;
+	alpha = ((double) j / (double) c->nsamples) * (r->alpha2 - r->alpha1) + r->alpha1;
+	alpha = alpha * alpha;
+	return r->last = r->last + alpha * (echo - r->last);
+}
+
+/* Frames [a, b) of the sound with reverb into out.  Returns -1 if cancelled. */
+static int reverb_window(struct explosion_def *e, struct reverb_cursor *c,
+		double *out, int a, int b)
+{
+	struct reflection *r;
+	int i, j, start;
+
+	for (i = a; i < b; i++)
+		out[i - a] = i < c->dry->nsamples ? c->dry->data[i] : 0.0;
+	for (i = 0; i < c->nrefls; i++) {
+		if (cancelled(e))
+			return -1;
+		r = &c->refl[i];
+		/* delay_effect_in_place() puts silence where the source is <= 0 */
+		j = a - r->delay > 1 ? a - r->delay : 1;
+		if (j >= b - r->delay)
+			continue;
+		if (r->next > j || r->next + REVERB_WARMUP < j) {
+			start = j - REVERB_WARMUP > 0 ? j - REVERB_WARMUP : 0;
+			r->next = start;
+			r->last = start < c->dry->nsamples ? c->dry->data[start] * r->scale : 0.0;
+			if (start)
+				r->next++;
+		}
+		while (r->next < j)
+			reflection_step(c, r);
+		for (; j < b - r->delay; j++)
+			out[j + r->delay - a] += reflection_step(c, r);
+		if (b == c->nsamples)
+			PROBE3(explodomatica, reflection__done, e->job_id, i, r->delay);
+	}
+	return 0;
+}
+
+/* Frames [a, b) of s, or as many of them as it has */
+static struct sound *slice_sound(struct sound *s, int a, int b)
+{
+	struct sound *o;
+
+	if (b > s->nsamples)
+		b = s->nsamples;
+	if (a > b)
+		a = b;
+	o = alloc_sound(b - a);
+	memcpy(o->data, s->data + a, sizeof(*o->data) * (b - a));
+	o->nsamples = b - a;
+	return o;
+}
+
+int explodomatica_dry(struct explosion_def *e, struct explodomatica_partial *p)
+{
+	if (e->input_file && strcmp(e->input_file, "") != 0)
+		read_input_file(e->input_file, &e->input_data, &e->input_samples);
+
+	rng_state = e->seed ? e->seed : (unsigned int) rand();
+	PROBE2(explodomatica, render__start, e->job_id, rng_state);
+
+	p->finished = e->fixed_point;
+	if (e->fixed_point) {
+		p->s = fx_render(e);
 	} else {
-		s2 = copy_sound(s);
-		if (!e->reverb && explodomatica_progress)
-			*explodomatica_progress = 0.9;	
+		p->s = render_mix(e);
+		if (p->s)
+			render_speed(e, p->s);
+	}
+	p->rng_state = rng_state;
+	if (!p->s)
+		PROBE2(explodomatica, render__done, e->job_id, 0);
+	return p->s ? 0 : -1;
+}
+
+struct sound *explodomatica_wet(struct explosion_def *e, struct explodomatica_partial *p)
+{
+	struct sound *s2;
+
+	if (p->finished) {
+		s2 = p->s;
+	} else {
+		rng_state = p->rng_state;
+		s2 = render_reverb(e, p->s, NULL);
+		destroy_sound(p->s);
 	}
+	p->s = NULL;
+	PROBE2(explodomatica, render__done, e->job_id, s2 ? s2->nsamples : 0);
+	return s2;
+}
+
+struct sound *explodomatica_window(struct explosion_def *e, int a, int b)
+{
+	struct explodomatica_partial p;
+	struct reverb_cursor c;
+	struct sound *s;
+
+	if (a < 0)
+		a = 0;
+	if (explodomatica_dry(e, &p) != 0)
+		return NULL;
+	if (p.finished || !e->reverb) {
+		/* everything left is cheap */
+		s = explodomatica_wet(e, &p);
+		if (s) {
+			struct sound *w = slice_sound(s, a, b);
+
+			destroy_sound(s);
+			s = w;
+		}
+		return s;
+	}
+
+	rng_state = p.rng_state;
+	s = NULL;
+	if (init_reverb_cursor(e, p.s, &c) == 0) {
+		if (b > c.nsamples)
+			b = c.nsamples;
+		if (a > b)
+			a = b;
+		s = alloc_sound(b - a);
+		s->nsamples = b - a;
+		stage_begin(e, EXPLODOMATICA_STAGE_REVERB);
+		if (reverb_window(e, &c, s->data, a, b) != 0) {
+			destroy_sound(s);
+			s = NULL;
+		}
+		stage_end(e, EXPLODOMATICA_STAGE_REVERB, s);
+		free(c.refl);
+	}
+	destroy_sound(p.s);
+	PROBE2(explodomatica, render__done, e->job_id, s ? s->nsamples : 0);
+	return s;
+}
+
+struct sound *explodomatica_stream(struct explosion_def *e, int block_frames,
+		explodomatica_block_callback f, void *arg)
+{
+	struct explodomatica_partial p;
+	struct reverb_cursor c;
+	struct sound *s;
+	int a, b;
 
-	if (strcmp(e->save_filename, "") != 0)
+	if (block_frames < 1)
+		block_frames = 1;
+	if (explodomatica_dry(e, &p) != 0)
+		return NULL;
+	if (p.finished || !e->reverb) {
+		s = explodomatica_wet(e, &p);
+		for (a = 0; s && a < s->nsamples; a += block_frames) {
+			b = a + block_frames < s->nsamples ? a + block_frames : s->nsamples;
+			f(e, s->data + a, a, b - a, s->nsamples, arg);
+		}
+		return s;
+	}
+
+	rng_state = p.rng_state;
+	s = NULL;
+	if (init_reverb_cursor(e, p.s, &c) == 0) {
+		s = alloc_sound(c.nsamples);
+		stage_begin(e, EXPLODOMATICA_STAGE_REVERB);
+		for (a = 0; a < c.nsamples; a = b) {
+			b = a + block_frames < c.nsamples ? a + block_frames : c.nsamples;
+			if (reverb_window(e, &c, s->data + a, a, b) != 0) {
+				destroy_sound(s);
+				s = NULL;
+				break;
+			}
+			s->nsamples = b;
+			if (explodomatica_progress && *explodomatica_progress < (float) b / c.nsamples)
+				*explodomatica_progress = (float) b / c.nsamples;
+			f(e, s->data + a, a, b - a, c.nsamples, arg);
+		}
+		if (s)
+			trim_trailing_silence(s);
+		stage_end(e, EXPLODOMATICA_STAGE_REVERB, s);
+		free(c.refl);
+	}
+	destroy_sound(p.s);
+	PROBE2(explodomatica, render__done, e->job_id, s ? s->nsamples : 0);
+	return s;
+}
+
+struct sound *explodomatica(struct explosion_def *e)
+{
+	struct explodomatica_partial p;
+	struct sound *s2;
+
+	if (explodomatica_dry(e, &p) != 0)
+		return NULL;
+	s2 = explodomatica_wet(e, &p);
+	if (!s2)
+		return NULL;
+
+	if (strcmp(e->save_filename, "") != 0) {
+		stage_begin(e, EXPLODOMATICA_STAGE_SAVE);
 		explodomatica_save_file(e->save_filename, s2, 1);
+		stage_end(e, EXPLODOMATICA_STAGE_SAVE, s2);
+	}
 
 	if (explodomatica_progress)
 		*explodomatica_progress = 1.0;	
-	free_sound(s);
-	free_sound(pe);
 	return s2;
 }
 
@@ -558,6 +1388,381 @@ void explodomatica_progress_variable(volatile float *progress)
 	explodomatica_progress = progress;
 }
 
+void explodomatica_quiet(int quiet)
+{
+	explodomatica_quiet_flag = quiet;
+}
+
+#define PARAM(name, type, field, stage) \
+	{ name, type, offsetof(struct explosion_def, field), EXPLODOMATICA_STAGE_##stage }
+
+static const struct param {
+	const char *name;
+	enum { PARAM_DOUBLE, PARAM_INT, PARAM_UINT } type;
+	size_t offset;
+	enum explodomatica_stage stage;	/* the first stage it affects */
+} params[] = {
+	PARAM("duration", PARAM_DOUBLE, duration, PREEXPLOSIONS),
+	PARAM("nlayers", PARAM_INT, nlayers, PREEXPLOSIONS),
+	PARAM("preexplosions", PARAM_INT, preexplosions, PREEXPLOSIONS),
+	PARAM("pre-delay", PARAM_DOUBLE, preexplosion_delay, PREEXPLOSIONS),
+	PARAM("pre-lp-factor", PARAM_DOUBLE, preexplosion_low_pass_factor, PREEXPLOSIONS),
+	PARAM("pre-lp-count", PARAM_INT, preexplosion_lp_iters, PREEXPLOSIONS),
+	PARAM("speedfactor", PARAM_DOUBLE, final_speed_factor, SPEED),
+	PARAM("early-refls", PARAM_INT, reverb_early_refls, REVERB),
+	PARAM("late-refls", PARAM_INT, reverb_late_refls, REVERB),
+	PARAM("reverb", PARAM_INT, reverb, REVERB),
+	PARAM("seed", PARAM_UINT, seed, PREEXPLOSIONS),
+	PARAM("fixed-point", PARAM_INT, fixed_point, PREEXPLOSIONS),
+};
+
+static const struct param *find_param(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(params); i++)
+		if (strcmp(name, params[i].name) == 0)
+			return &params[i];
+	return NULL;
+}
+
+/* Integer parameters are rounded */
+static void set_param_value(struct explosion_def *e, const struct param *p, double value)
+{
+	char *field = (char *) e + p->offset;
+
+	switch (p->type) {
+	case PARAM_DOUBLE:
+		*(double *) field = value;
+		break;
+	case PARAM_INT:
+		*(int *) field = (int) floor(value + 0.5);
+		break;
+	case PARAM_UINT:
+		*(unsigned int *) field = (unsigned int) floor(value + 0.5);
+		break;
+	}
+}
+
+int explodomatica_set_param(struct explosion_def *e,
+		const char *name, const char *value)
+{
+	const struct param *p = find_param(name);
+	char *field;
+	char extra;
+
+	if (!p)
+		return -1;
+	field = (char *) e + p->offset;
+	switch (p->type) {
+	case PARAM_DOUBLE:
+		return sscanf(value, "%lg%c", (double *) field, &extra) == 1 ? 0 : -1;
+	case PARAM_INT:
+		return sscanf(value, "%d%c", (int *) field, &extra) == 1 ? 0 : -1;
+	case PARAM_UINT:
+		return sscanf(value, "%u%c", (unsigned int *) field, &extra) == 1 ? 0 : -1;
+	}
+	return -1;
+}
+
+/* Append " name=value" (no space if at the start of buf) */
+static int format_param(struct explosion_def *e, const struct param *p,
+		char *buf, int buflen, int len)
+{
+	char *field = (char *) e + p->offset;
+	const char *sep = len ? " " : "";
+	int n;
+
+	switch (p->type) {
+	case PARAM_DOUBLE:
+		n = snprintf(buf + len, buflen - len, "%s%s=%.17g", sep, p->name, *(double *) field);
+		break;
+	case PARAM_INT:
+		n = snprintf(buf + len, buflen - len, "%s%s=%d", sep, p->name, *(int *) field);
+		break;
+	default:
+		n = snprintf(buf + len, buflen - len, "%s%s=%u", sep, p->name,
+			*(unsigned int *) field);
+		break;
+	}
+	if (n < 0 || n >= buflen - len)
+		return -1;
+	return len + n;
+}
+
+int explodomatica_canonical_params(struct explosion_def *e, char *buf, int buflen)
+{
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < ARRAYSIZE(params) && len >= 0; i++)
+		len = format_param(e, &params[i], buf, buflen, len);
+	return len;
+}
+
+/*
+ * Planning for explodomatica_render_many().  Each def gets a key made of
+ * the parameters the mix depends on, then "|" and those of the speed
+ * change, then "|" and those of the reverb apart from late-refls.  Defs
+ * sorted by key and late-refls then share a mix with their neighbours
+ * up to the first "|" in which they differ, a sped-up sound up to the
+ * second, and a reverb run if the whole key matches: a reverb with fewer
+ * late reflections is a snapshot of one with more.
+ */
+#define MAX_PLAN_KEY 1024
+
+struct plan_entry {
+	char key[MAX_PLAN_KEY];
+	int speed_len, reverb_len;	/* where those parts of key start */
+	int late_refls;
+	int index;
+};
+
+static void plan_def(struct explosion_def *e, int index, struct plan_entry *pe)
+{
+	static const enum explodomatica_stage parts[] = {
+		EXPLODOMATICA_STAGE_MIX, EXPLODOMATICA_STAGE_SPEED, EXPLODOMATICA_STAGE_REVERB,
+	};
+	enum explodomatica_stage first = EXPLODOMATICA_STAGE_PREEXPLOSIONS;
+	unsigned int i, j;
+	int len;
+
+	/* nothing is shared by random seeds or the fixed point engine */
+	if (!e->seed || e->fixed_point)
+		len = snprintf(pe->key, sizeof(pe->key), "#%d %s", index, e->input_file);
+	else
+		len = snprintf(pe->key, sizeof(pe->key), "%s", e->input_file);
+	for (j = 0; j < ARRAYSIZE(parts); j++) {
+		if (j == 1)
+			pe->speed_len = len;
+		else if (j == 2)
+			pe->reverb_len = len;
+		if (j && len >= 0 && len < (int) sizeof(pe->key) - 1)
+			pe->key[len++] = '|';
+		for (i = 0; i < ARRAYSIZE(params) && len >= 0; i++) {
+			if (params[i].stage < first || params[i].stage > parts[j] ||
+				params[i].offset == offsetof(struct explosion_def, reverb_late_refls))
+				continue;
+			len = format_param(e, &params[i], pe->key, sizeof(pe->key), len);
+		}
+		first = parts[j] + 1;
+	}
+	pe->late_refls = e->reverb_late_refls > 0 ? e->reverb_late_refls : 0;
+	pe->index = index;
+}
+
+int explodomatica_mix_key(struct explosion_def *e, char *buf, int buflen)
+{
+	struct plan_entry pe;
+
+	if (!e->seed || e->fixed_point)
+		return 0;
+	plan_def(e, 0, &pe);
+	if (pe.speed_len < 0 || pe.speed_len >= buflen)
+		return -1;
+	memcpy(buf, pe.key, pe.speed_len);
+	buf[pe.speed_len] = '\0';
+	return pe.speed_len;
+}
+
+static int compare_plan(const void *a, const void *b)
+{
+	const struct plan_entry *pa = a, *pb = b;
+	int c = strcmp(pa->key, pb->key);
+
+	if (c)
+		return c;
+	return pa->late_refls - pb->late_refls;
+}
+
+/* Whether a and b agree up to (not including) the key part at len */
+static int same_plan(struct plan_entry *a, struct plan_entry *b, int len_a, int len_b)
+{
+	return len_a == len_b && strncmp(a->key, b->key, len_a) == 0;
+}
+
+/* The reverb stage for plan[0..n-1], which all differ only in late-refls */
+static int render_reverbs(struct explosion_def *defs, struct plan_entry *plan, int n,
+		struct sound *s, explodomatica_sweep_callback f, void *arg)
+{
+	struct explosion_def v = defs[plan[0].index];
+	struct reverb_snapshots snap;
+	struct sound *full;
+	int *late_refls;
+	int i, rc = 0;
+
+	if (!v.reverb || n == 1) {
+		for (i = 0; i < n && rc == 0; i++) {
+			full = render_reverb(&defs[plan[i].index], s, NULL);
+			if (full)
+				f(&defs[plan[i].index], plan[i].index, full, arg);
+			else
+				rc = -1;
+		}
+		return rc;
+	}
+
+	late_refls = malloc(sizeof(*late_refls) * n);
+	snap.copies = calloc(n, sizeof(*snap.copies));
+	snap.late_refls = late_refls;
+	snap.n = n;
+	for (i = 0; i < n; i++)
+		late_refls[i] = plan[i].late_refls;
+	v.reverb_late_refls = late_refls[n - 1];
+	full = render_reverb(&v, s, &snap);
+	if (full)
+		destroy_sound(full);
+	else
+		rc = -1;
+	for (i = 0; i < n; i++) {
+		if (rc == 0)
+			f(&defs[plan[i].index], plan[i].index, snap.copies[i], arg);
+		else if (snap.copies[i])
+			destroy_sound(snap.copies[i]);
+	}
+	free(snap.copies);
+	free(late_refls);
+	return rc;
+}
+
+int explodomatica_render_many(struct explosion_def *defs, int n,
+		explodomatica_sweep_callback f, void *arg)
+{
+	struct plan_entry *plan;
+	struct sound *mix = NULL, *sped = NULL, *s;
+	struct explosion_def *e;
+	unsigned int rng_after_mix = 0;
+	int i, j, prev = -1, rc = 0;
+
+	plan = malloc(sizeof(*plan) * n);
+	if (!plan)
+		return -1;
+	for (i = 0; i < n; i++) {
+		e = &defs[i];
+		if (strcmp(e->input_file, "") != 0 && !e->input_data)
+			read_input_file(e->input_file, &e->input_data, &e->input_samples);
+		plan_def(e, i, &plan[i]);
+	}
+	qsort(plan, n, sizeof(*plan), compare_plan);
+
+	for (i = 0; i < n && rc == 0; i = j) {
+		for (j = i + 1; j < n; j++)
+			if (strcmp(plan[i].key, plan[j].key) != 0)
+				break;
+		e = &defs[plan[i].index];
+		if (e->fixed_point) {
+			rng_state = e->seed ? e->seed : (unsigned int) rand();
+			s = fx_render(e);
+			if (s)
+				f(e, plan[i].index, s, arg);
+			else
+				rc = -1;
+			continue;
+		}
+		if (prev < 0 || !same_plan(&plan[prev], &plan[i],
+				plan[prev].speed_len, plan[i].speed_len)) {
+			if (mix)
+				destroy_sound(mix);
+			rng_state = e->seed ? e->seed : (unsigned int) rand();
+			mix = render_mix(e);
+			if (!mix) {
+				rc = -1;
+				break;
+			}
+			rng_after_mix = rng_state;
+			if (sped)
+				destroy_sound(sped);
+			sped = NULL;
+		}
+		if (!sped || !same_plan(&plan[prev], &plan[i],
+				plan[prev].reverb_len, plan[i].reverb_len)) {
+			if (sped)
+				destroy_sound(sped);
+			sped = copy_sound(mix);
+			render_speed(e, sped);
+		}
+		rng_state = rng_after_mix;
+		rc = render_reverbs(defs, plan + i, j - i, sped, f, arg);
+		prev = i;
+	}
+	if (mix)
+		destroy_sound(mix);
+	if (sped)
+		destroy_sound(sped);
+	free(plan);
+	return rc;
+}
+
+int explodomatica_sweep(struct explosion_def *e, const char *param,
+		const double *values, int nvalues,
+		explodomatica_sweep_callback f, void *arg)
+{
+	const struct param *p = find_param(param);
+	struct explosion_def v = *e, *defs;
+	int i, rc;
+
+	if (!p)
+		return -1;
+	defs = malloc(sizeof(*defs) * nvalues);
+	if (!defs)
+		return -1;
+	if (strcmp(v.input_file, "") != 0)
+		read_input_file(v.input_file, &v.input_data, &v.input_samples);
+	if (!v.seed)
+		v.seed = (unsigned int) rand();
+	for (i = 0; i < nvalues; i++) {
+		defs[i] = v;
+		set_param_value(&defs[i], p, values[i]);
+	}
+	rc = explodomatica_render_many(defs, nvalues, f, arg);
+	free(defs);
+	return rc;
+}
+
+/* Peak size of the make_explosion() working set, in samples: the layers
+ * kept so far, each 1/(2i) as long as the first, plus a full length
+ * layer being made and a temporary copy of it.
+ */
+static double explosion_peak(double nsamples, int nlayers)
+{
+	double held = nsamples;
+	int i;
+
+	for (i = 1; i < nlayers; i++)
+		held += nsamples / (2 * i);
+	return held + 2 * nsamples;
+}
+
+void explodomatica_estimate(struct explosion_def *e, double *peak_bytes, double *cost)
+{
+	double n = seconds_to_frames(e->duration), m, peak, reverb;
+	int nlayers = e->nlayers > 0 ? e->nlayers : 1;
+
+	m = e->final_speed_factor > 0.0 ? n / e->final_speed_factor : n;
+
+	/* pre-explosions, then the main explosion alongside them */
+	peak = e->preexplosions ? n + explosion_peak(n / 2, nlayers) + n : 0;
+	if (n + explosion_peak(n, nlayers) > peak)
+		peak = n + explosion_peak(n, nlayers);
+	if (3 * n > peak)		/* mix */
+		peak = 3 * n;
+	if (n + m > peak)		/* speed change */
+		peak = n + m;
+	/* reverb: the input, then output, echo, filtered echo and a
+	 * temporary sum at twice the length
+	 */
+	reverb = e->reverb ? 9 * m : 2 * m;
+	if (reverb > peak)
+		peak = reverb;
+	*peak_bytes = peak * (e->fixed_point ? sizeof(int32_t) : sizeof(double));
+
+	/* about 8 passes over each layer, 5 over each reflection */
+	*cost = 8.0 * nlayers * (n + e->preexplosions * n / 2) +
+		e->preexplosion_lp_iters * n + n + m;
+	if (e->reverb)
+		*cost += 5.0 * 2 * m * (e->reverb_early_refls + e->reverb_late_refls);
+}
+
 void *threadfunc(void *arg)
 {
 	struct explodomatica_thread_arg *a = arg;
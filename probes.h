@@ -0,0 +1,61 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+/* 
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/*
+ * Static tracepoints.  When systemtap's <sys/sdt.h> is available these
+ * become USDT probes, which cost a nop each until a tracer attaches:
+ *
+ *	bpftrace -e 'usdt:./explodomaticad:explodomatica:stage__done
+ *		{ @[arg1] = hist(arg2); }'
+ *
+ * Otherwise, or with -DNO_SDT_PROBES, they compile to nothing.
+ *
+ * Probes in provider "explodomatica" (libexplodomatica.c); job is
+ * explosion_def.job_id:
+ *	render__start(job, seed)		render__done(job, nsamples)
+ *	stage__start(job, stage)		stage__done(job, stage, nsamples)
+ *	layer__done(job, layer, nsamples)
+ *	reflection__done(job, reflection, delay)
+ * and in provider "wwviaudio" (wwviaudio.c), around each audio callback:
+ *	mix__start(stream_frame, frames)	mix__done(stream_frame, frames)
+ */
+
+#if !defined(NO_SDT_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_SDT_PROBES
+#define PROBE1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#define PROBE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#define PROBE1(provider, name, a) do { (void) (a); } while (0)
+#define PROBE2(provider, name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(provider, name, a, b, c) \
+	do { (void) (a); (void) (b); (void) (c); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+/* 
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include "slider_specs.h"
+
+struct slider_spec sliderspeclist[NSLIDER_SPECS] = {
+	{ "Layers:", 1.0, 6.0, 1.0, 4.0,
+			"Specifies number of sound layers to use to build up each explosion",
+			"nlayers" },
+	{ "Duration (secs):", 0.2, 60.0, 0.05, 15.0,
+			"Specifies duration of explosion in seconds",
+			"duration" },
+	{ "Pre-explosions:", 0.0, 5.0, 1.0, 1.0,
+			"Number of \"pre-explosions\" to use.  You can think of pre-explosions "
+			"as the \"ka-\" in \"ka-BOOM!\"",
+			"preexplosions" },
+	{ "Pre-delay:", 0.1, 3.0, 0.05, 0.20,
+			"Duration of \"pre-explosions\" in seconds before the \"main\" "
+			"explosion kicks in.",
+			"pre-delay" },
+	{ "Pre-lp-factor:", 0.2, 0.9, 0.05, 0.8,
+			"Specifies the impact of the low pass filter used "
+			"on the pre-explosion part of the sound. Values "
+			"closer to zero lower the cutoff frequency "
+			"while values close to one raise the cutoff frequency. "
+			"Value should be between 0.2 and 0.9. "
+			"Default is 0.800000",
+			"pre-lp-factor" },
+	{ "Pre-lp-count:", 0, 10, 1.0, 2.0,
+			"Specifies the number of times the low pass filter used "
+			"on the pre-explosion part of the sound.",
+			"pre-lp-count" },
+	{ "Speed factor:", 0.1, 10.0, 0.05, 1.0,
+			"Amount to speed up (or slow down) the final "
+			"explosion sound. Values greater than 1.0 speed "
+			"the sound up, values less than 1.0 slow it down.",
+			"speedfactor" },
+	{ "Reverb early refls:", 1.0, 50.0, 1.0, 5.0,
+			"Number of early reflections in reverb",
+			"early-refls" },
+	{ "Reverb late refls:", 1.0, 1000.0, 1.0, 40.0,
+			"Number of late reflections in reverb",
+			"late-refls" },
+};
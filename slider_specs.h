@@ -0,0 +1,39 @@
+#ifndef __SLIDER_SPECS_H__
+#define __SLIDER_SPECS_H__
+/* 
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/* Ranges of the parameters gexplodomatica offers sliders for, shared
+ * with tools that want to generate realistic parameter mixes.
+ */
+struct slider_spec {
+	char *labeltext;
+	double r1, r2, inc, initial_value;
+	char *tooltiptext;
+	char *param;	/* name for explodomatica_set_param() */
+};
+
+#define NSLIDER_SPECS 9
+
+/* Defined in slider_specs.c */
+extern struct slider_spec sliderspeclist[NSLIDER_SPECS];
+
+#endif
@@ -19,25 +19,30 @@
 
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define WWVIAUDIO_DEFINE_GLOBALS
+#include "wwviaudio.h"
+#undef WWVIAUDIO_DEFINE_GLOBALS
+
 #ifndef WWVIAUDIO_STUBS_ONLY
 
 #include <stdio.h>
-#include <stdint.h>
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
-
-#define WWVIAUDIO_DEFINE_GLOBALS
-#include "wwviaudio.h"
-#undef WWVIAUDIO_DEFINE_GLOBALS
+#include <math.h>
+#include <pthread.h>
 
 #include "portaudio.h"
 #include "ogg_to_pcm.h"
+#include "probes.h"
 
-#define FRAMES_PER_BUFFER  (1024)
+#define FRAMES_PER_BUFFER  (1024)	/* default, see wwviaudio_set_buffer_size() */
 
 static PaStream *stream = NULL;
 static int audio_paused = 0;
@@ -48,6 +53,71 @@ static int sound_effects_on = 1;
 static int sound_device = -1; /* default sound device for port audio. */
 static unsigned int max_concurrent_sounds = 0;
 static int max_sound_clips = 0;
+static int output_channels = 1;
+static unsigned long frames_per_buffer = FRAMES_PER_BUFFER;
+static unsigned long mix_frames = FRAMES_PER_BUFFER;	/* size of the scratch buffers */
+static double suggested_latency = 0.0;	/* 0.0 means the device's default low latency */
+static int requested_sample_rate = WWVIAUDIO_SAMPLE_RATE; /* 0 means the device's own */
+static int output_rate = WWVIAUDIO_SAMPLE_RATE;	/* rate the stream runs at */
+
+/* Mixer clock: frames mixed since the stream started, not counting
+ * time spent paused.  Written only by the callback.
+ */
+static uint64_t stream_frame = 0;
+
+/* Scratch buffers the callback mixes into, allocated at init so the
+ * callback never has to malloc().  mixbuf is the dry output, reverb_bus
+ * is the sum of every voice times its reverb send level.
+ */
+static float *mixbuf = NULL;
+static float *mixbuf_right = NULL;	/* stereo output only */
+static float *reverb_bus = NULL;
+
+/* Shared reverb on the send bus: a 4 line feedback delay network.
+ * One instance serves every voice, so dry clips get a common ambience
+ * without each clip carrying its own rendered tail.
+ */
+#define REVERB_LINES 4
+static const int reverb_line_length[REVERB_LINES] = { 1433, 1601, 1867, 2053 };
+static struct reverb_line {
+	float *buffer;
+	int length;
+	int pos;
+	float gain;	/* per pass feedback gain, derived from decay time */
+	float lp;	/* damping low pass state */
+} reverb[REVERB_LINES];
+static float reverb_decay = 1.5;	/* seconds to decay by 60dB */
+static float reverb_damping = 0.3;	/* 0.0 bright .. 1.0 dark */
+static float reverb_level = 0.5;	/* return level of the bus */
+static int reverb_idle_frames = 0;	/* frames since bus last had input */
+static int reverb_tail_frames = 0;	/* frames after which the tail is silent */
+
+/* Look-ahead peak limiter on the master bus.  The output is delayed by
+ * LIMITER_LOOKAHEAD frames so the gain can ramp down before a peak
+ * reaches the output instead of clipping it.  Cost is constant per frame.
+ */
+#define LIMITER_LOOKAHEAD 128	/* ~3ms at 44.1kHz */
+#define LIMITER_THRESHOLD 0.98
+#define LIMITER_RELEASE_SECS 0.1
+static float *limiter_delay = NULL;	/* LIMITER_LOOKAHEAD frames per channel */
+static int limiter_pos = 0;
+static float limiter_gain = 1.0;
+static float limiter_floor = 1.0;	/* lowest gain still to be reached */
+static float limiter_step = 0.0;	/* per frame gain change while attacking */
+static int limiter_hold = 0;		/* frames to hold before releasing */
+static float limiter_release = 0.0;	/* per frame release coefficient */
+
+/* Voice virtualization.  Voices quieter than the audibility threshold,
+ * or beyond the max_real_voices loudest, are virtual: their position
+ * advances but they are not mixed.  They become real again as soon as
+ * they are loud enough, so timing is unaffected.
+ */
+static float audibility_threshold = 0.001;	/* -60dB */
+static unsigned int max_real_voices = 0;	/* 0 means no limit */
+static float *voice_audibility = NULL;		/* callback scratch */
+static float *audibility_scratch = NULL;	/* callback scratch */
+static volatile int real_voice_count = 0;
+static volatile int virtual_voice_count = 0;
 
 /* Pause all audio output, output silence. */
 void wwviaudio_pause_audio(void)
@@ -100,57 +170,274 @@ void wwviaudio_set_nomusic(void)
 	nomusic = 1;
 }
 
+int wwviaudio_set_output_channels(int channels)
+{
+	if (channels != 1 && channels != 2)
+		return -1;
+	output_channels = channels;
+	return 0;
+}
+
+int wwviaudio_set_sample_rate(int rate)
+{
+	if (rate < 0)
+		return -1;
+	requested_sample_rate = rate;
+	return 0;
+}
+
+int wwviaudio_get_sample_rate(void)
+{
+	return output_rate;
+}
+
+int wwviaudio_set_buffer_size(int frames)
+{
+	if (frames < 0)
+		return -1;
+	frames_per_buffer = (unsigned long) frames;
+	return 0;
+}
+
+void wwviaudio_set_latency(double seconds)
+{
+	suggested_latency = seconds;
+}
+
 static struct sound_clip {
 	int active;
 	int nsamples;
 	int pos;
 	int16_t *sample;
+	char *filename;		/* to read the clip back in after eviction */
+	uint64_t last_used;	/* clip_use_clock when last played */
+	int streaming;		/* samples are still being appended */
+	int capacity;		/* of sample, while streaming */
 } *clip = NULL;
 
-static struct sound_clip *audio_queue = NULL;
+/* Clip memory accounting.  Clips read from files may be evicted, least
+ * recently played first, when the total goes over budget, and are read
+ * back in the next time they are played.  clip_mutex protects the clip
+ * table; when both are needed it is taken before submit_mutex.
+ */
+static size_t clip_memory_budget = 0;	/* 0 means unlimited */
+static size_t clip_memory_used = 0;
+static uint64_t clip_use_clock = 0;
+static pthread_mutex_t clip_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* A channel, aka voice.  Only the audio callback touches a voice, except
+ * for state, which a producer flips from VOICE_FREE to VOICE_RESERVED to
+ * claim the slot before sending the callback a command to start it, and
+ * pending_sample, which is the producer's own record of what it started.
+ */
+#define VOICE_FREE 0
+#define VOICE_RESERVED 1
+#define VOICE_ACTIVE 2
+
+static struct voice {
+	int state;
+	int nsamples;
+	int pos;		/* negative until the voice's first frame */
+	int16_t *sample;
+	struct sound_clip *stream;	/* the clip, if it is still streaming */
+	float reverb_send;
+	float volume;
+	float pan;
+	int16_t *pending_sample;
+} *audio_queue = NULL;
+
+/* Everything that changes what the callback plays goes through a single
+ * producer, single consumer ring of commands.  Producers serialize on
+ * submit_mutex and publish any number of commands with one store to
+ * command_head; the callback drains the ring at the start of each buffer.
+ */
+#define CMD_START 0
+#define CMD_CANCEL 1
+#define CMD_CANCEL_ALL 2
+#define CMD_SET_VOLUME 3
+#define CMD_SET_PAN 4
+#define CMD_SET_REVERB_SEND 5
+#define CMD_SET_REVERB 6	/* decay, damping and level in volume, pan, reverb_send */
+
+struct audio_command {
+	int type;
+	int slot;
+	int16_t *sample;
+	int nsamples;
+	struct sound_clip *stream;
+	int offset;		/* frames after when, or after the start of
+				 * the buffer the command lands in if !timed */
+	int timed;
+	uint64_t when;		/* mixer clock frame, if timed */
+	float volume;		/* also the value for the CMD_SET_ commands */
+	float pan;
+	float reverb_send;
+};
+
+#define COMMAND_RING_SIZE 1024	/* must be a power of 2 */
+static struct audio_command *command_ring = NULL;
+static unsigned int command_head = 0;	/* written by producers */
+static unsigned int command_tail = 0;	/* written by the callback */
+static pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #ifndef DATADIR
 #define DATADIR "."
 #endif
 
-int wwviaudio_read_ogg_clip(int clipnum, char *filename)
+/* Average interleaved channels down to one, as floats in -1.0 .. 1.0 */
+static float *downmix(int16_t *pcm, int nframes, int nchannels)
+{
+	float *mono;
+	float scale;
+	int i, j, acc;
+
+	mono = malloc(sizeof(*mono) * (nframes > 0 ? nframes : 1));
+	if (mono == NULL)
+		return NULL;
+	scale = 1.0 / ((float) INT16_MAX * (float) nchannels);
+	for (i = 0; i < nframes; i++) {
+		acc = 0;
+		for (j = 0; j < nchannels; j++)
+			acc += pcm[i * nchannels + j];
+		mono[i] = (float) acc * scale;
+	}
+	return mono;
+}
+
+static inline int16_t float_to_int16(float x)
+{
+	x = x * 32767.0;
+	if (x > 32767.0)
+		return 32767;
+	if (x < -32767.0)
+		return -32767;
+	return (int16_t) lrintf(x);
+}
+
+/* Convert in (nframes at in_rate) to output_rate with 4 point cubic
+ * Hermite interpolation.  Cheap, and plenty good enough for the
+ * 44.1 <-> 48kHz conversions we expect, though it does not band limit
+ * when downsampling by large factors.  Returns a malloced buffer and
+ * stores its length in *out_frames.
+ */
+static int16_t *resample(float *in, int nframes, int in_rate, int *out_frames)
+{
+	int16_t *out;
+	int i, n, k;
+	double step, pos;
+	float frac, xm1, x0, x1, x2, c1, c2, c3;
+
+	if (in_rate == output_rate) {
+		n = nframes;
+		step = 1.0;
+	} else {
+		n = (int) ((double) nframes * output_rate / in_rate);
+		step = (double) in_rate / (double) output_rate;
+	}
+	out = malloc(sizeof(*out) * (n > 0 ? n : 1));
+	if (out == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		pos = (double) i * step;
+		k = (int) pos;
+		frac = (float) (pos - k);
+		x0 = in[k];
+		xm1 = k > 0 ? in[k - 1] : x0;
+		x1 = k + 1 < nframes ? in[k + 1] : x0;
+		x2 = k + 2 < nframes ? in[k + 2] : x1;
+		c1 = 0.5 * (x1 - xm1);
+		c2 = xm1 - 2.5 * x0 + 2.0 * x1 - 0.5 * x2;
+		c3 = 0.5 * (x2 - xm1) + 1.5 * (x0 - x1);
+		out[i] = float_to_int16(((c3 * frac + c2) * frac + c1) * frac + x0);
+	}
+	*out_frames = n;
+	return out;
+}
+
+/* Free a clip's samples and take them off the memory books.
+ * Called with clip_mutex held.
+ */
+static void drop_clip(int clipnum)
+{
+	if (clip[clipnum].sample == NULL)
+		return;
+	free(clip[clipnum].sample);
+	if (!clip[clipnum].streaming)
+		clip_memory_used -= sizeof(clip[clipnum].sample[0]) * clip[clipnum].nsamples;
+	clip[clipnum].sample = NULL;
+	clip[clipnum].nsamples = 0;
+	clip[clipnum].streaming = 0;
+}
+
+/* Called with clip_mutex held. */
+static void account_clip(int clipnum)
+{
+	if (clip[clipnum].sample == NULL)
+		return;
+	clip_memory_used += sizeof(clip[clipnum].sample[0]) * clip[clipnum].nsamples;
+}
+
+/* Called with clip_mutex held. */
+static int clip_in_use(int clipnum)
+{
+	unsigned int i;
+
+	if (clip[clipnum].sample == NULL)
+		return 0;
+	/* sample covers the music channel, whose pending_sample is replaced
+	 * before the callback has stopped playing the old music.
+	 */
+	for (i = 0; i < max_concurrent_sounds; i++)
+		if (__atomic_load_n(&audio_queue[i].state, __ATOMIC_ACQUIRE) != VOICE_FREE &&
+			(audio_queue[i].pending_sample == clip[clipnum].sample ||
+			__atomic_load_n(&audio_queue[i].sample, __ATOMIC_ACQUIRE) ==
+				clip[clipnum].sample))
+			return 1;
+	return 0;
+}
+
+/* While over budget, drop the least recently played clip that can be
+ * read back in from its file and isn't playing.  Clip keep is spared.
+ * Called with clip_mutex held.
+ */
+static void evict_clips(int keep)
+{
+	int i, victim;
+
+	while (clip_memory_budget && clip_memory_used > clip_memory_budget) {
+		victim = -1;
+		for (i = 0; i < max_sound_clips; i++) {
+			if (i == keep || clip[i].sample == NULL ||
+				clip[i].filename == NULL || clip_in_use(i))
+				continue;
+			if (victim < 0 || clip[i].last_used < clip[victim].last_used)
+				victim = i;
+		}
+		if (victim < 0)
+			break;	/* everything left is pinned or playing */
+		drop_clip(victim);
+	}
+}
+
+/* Decode filebuf into the clip.  Called with clip_mutex held. */
+static int load_ogg_clip(int clipnum, char *filebuf)
 {
 	uint64_t nframes;
-	char filebuf[PATH_MAX];
-	struct stat statbuf;
 	int samplesize, sample_rate;
 	int nchannels;
 	int rc;
+	int16_t *pcm;
+	float *mono;
 
-	if (clipnum >= max_sound_clips || clipnum < 0)
-		return -1;
-
-	snprintf(filebuf, PATH_MAX, "%s/%s", DATADIR, filename);
-	rc = stat(filebuf, &statbuf);
-	if (rc != 0) {
-		strncpy(filebuf, filename, PATH_MAX);
-		rc = stat(filebuf, &statbuf);
-		if (rc != 0) {
-			fprintf(stderr, "stat('%s') failed.\n", filebuf);
-			return -1;
-		}
-	}
-/*
-	printf("Reading sound file: '%s'\n", filebuf);
-	printf("frames = %lld\n", sfinfo.frames);
-	printf("samplerate = %d\n", sfinfo.samplerate);
-	printf("channels = %d\n", sfinfo.channels);
-	printf("format = %d\n", sfinfo.format);
-	printf("sections = %d\n", sfinfo.sections);
-	printf("seekable = %d\n", sfinfo.seekable);
-*/
 	if (clip[clipnum].sample != NULL)
 		/* overwriting a previously read clip... */
-		free(clip[clipnum].sample);
+		drop_clip(clipnum);
 
-	rc = ogg_to_pcm(filebuf, &clip[clipnum].sample, &samplesize,
+	pcm = NULL;
+	rc = ogg_to_pcm(filebuf, &pcm, &samplesize,
 		&sample_rate, &nchannels, &nframes);
-	if (clip[clipnum].sample == NULL) {
+	if (pcm == NULL) {
 		printf("Can't get memory for sound data for %lu frames in %s\n",
 			nframes, filebuf);
 		goto error;
@@ -159,37 +446,638 @@ int wwviaudio_read_ogg_clip(int clipnum, char *filename)
 	if (rc != 0) {
 		fprintf(stderr, "Error: ogg_to_pcm('%s') failed.\n",
 			filebuf);
+		free(pcm);
 		goto error;
 	}
 
-	clip[clipnum].nsamples = (int) nframes;
+	/* The mixer plays mono clips at output_rate, so convert once here
+	 * rather than in the callback.
+	 */
+	if (nchannels == 1 && sample_rate == output_rate) {
+		clip[clipnum].sample = pcm;
+		clip[clipnum].nsamples = (int) nframes;
+	} else {
+		mono = downmix(pcm, (int) nframes, nchannels);
+		free(pcm);
+		if (mono == NULL)
+			goto error;
+		clip[clipnum].sample = resample(mono, (int) nframes,
+				sample_rate, &clip[clipnum].nsamples);
+		free(mono);
+		if (clip[clipnum].sample == NULL)
+			goto error;
+	}
 	if (clip[clipnum].nsamples < 0)
 		clip[clipnum].nsamples = 0;
+	account_clip(clipnum);
 
 	return 0;
 error:
+	clip[clipnum].nsamples = 0;
 	return -1;
 }
 
+/* Find filename, either under DATADIR or as given, and remember it as
+ * the clip's file.  Called with clip_mutex held.
+ */
+static int set_clip_file(int clipnum, char *filename)
+{
+	char filebuf[PATH_MAX];
+	struct stat statbuf;
+	int rc;
+
+	snprintf(filebuf, PATH_MAX, "%s/%s", DATADIR, filename);
+	rc = stat(filebuf, &statbuf);
+	if (rc != 0) {
+		strncpy(filebuf, filename, PATH_MAX);
+		rc = stat(filebuf, &statbuf);
+		if (rc != 0) {
+			fprintf(stderr, "stat('%s') failed.\n", filebuf);
+			return -1;
+		}
+	}
+	if (clip[clipnum].filename)
+		free(clip[clipnum].filename);
+	clip[clipnum].filename = strdup(filebuf);
+	return clip[clipnum].filename ? 0 : -1;
+}
+
+int wwviaudio_read_ogg_clip(int clipnum, char *filename)
+{
+	int rc;
+
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+
+	pthread_mutex_lock(&clip_mutex);
+	rc = set_clip_file(clipnum, filename);
+	if (rc == 0)
+		rc = load_ogg_clip(clipnum, clip[clipnum].filename);
+	evict_clips(clipnum);
+	pthread_mutex_unlock(&clip_mutex);
+	return rc;
+}
+
+int wwviaudio_register_ogg_clip(int clipnum, char *filename)
+{
+	int rc;
+
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+
+	pthread_mutex_lock(&clip_mutex);
+	drop_clip(clipnum);
+	rc = set_clip_file(clipnum, filename);
+	pthread_mutex_unlock(&clip_mutex);
+	return rc;
+}
+
+/* Make sure a clip about to be played is in memory, reading it back in
+ * if it was evicted, and note that it was played.  Nothing is evicted
+ * here; the caller does that once the clip's voice is reserved, so it
+ * counts as in use.  Called with clip_mutex held.
+ */
+static int prepare_clip(int clipnum)
+{
+	if (clip[clipnum].sample == NULL && clip[clipnum].filename != NULL)
+		if (load_ogg_clip(clipnum, clip[clipnum].filename) != 0)
+			return -1;
+	clip[clipnum].last_used = ++clip_use_clock;
+	return 0;
+}
+
 int wwviaudio_use_double_clip(int clipnum, double *sample, int nsamples)
 {
-	int i;
+	int i, rc = 0;
+	float *f;
 
 	if (clipnum >= max_sound_clips || clipnum < 0)
 		return -1;
 
-	if (clip[clipnum].sample != NULL)
-		/* overwriting a previously read clip... */
-		free(clip[clipnum].sample);
+	pthread_mutex_lock(&clip_mutex);
+	/* overwriting a previously read clip... */
+	drop_clip(clipnum);
+	/* there is no file to read this back in from, so it's never evicted */
+	if (clip[clipnum].filename) {
+		free(clip[clipnum].filename);
+		clip[clipnum].filename = NULL;
+	}
+
+	/* double clips come from explodomatica, at WWVIAUDIO_SAMPLE_RATE */
+	if (output_rate != WWVIAUDIO_SAMPLE_RATE) {
+		f = malloc(sizeof(*f) * nsamples);
+		if (f == NULL) {
+			rc = -1;
+			goto out;
+		}
+		for (i = 0; i < nsamples; i++)
+			f[i] = (float) sample[i];
+		clip[clipnum].sample = resample(f, nsamples,
+				WWVIAUDIO_SAMPLE_RATE, &clip[clipnum].nsamples);
+		free(f);
+		if (clip[clipnum].sample == NULL)
+			rc = -1;
+		goto out;
+	}
 
 	clip[clipnum].sample = malloc(sizeof(clip[clipnum].sample[0]) * nsamples);
+	if (clip[clipnum].sample == NULL) {
+		rc = -1;
+		goto out;
+	}
 
 	for (i = 0; i < nsamples; i++) 
 		clip[clipnum].sample[i] = (int16_t) (sample[i] * 32767.0); 
 	clip[clipnum].nsamples = nsamples;
+out:
+	account_clip(clipnum);
+	evict_clips(clipnum);
+	pthread_mutex_unlock(&clip_mutex);
+	return rc;
+}
+
+int wwviaudio_begin_stream_clip(int clipnum, int capacity)
+{
+	int rc = 0;
+
+	/* a stream can't be resampled a block at a time */
+	if (clipnum >= max_sound_clips || clipnum < 0 || capacity < 0 ||
+			output_rate != WWVIAUDIO_SAMPLE_RATE)
+		return -1;
+
+	pthread_mutex_lock(&clip_mutex);
+	drop_clip(clipnum);
+	if (clip[clipnum].filename) {
+		free(clip[clipnum].filename);
+		clip[clipnum].filename = NULL;
+	}
+	clip[clipnum].sample = malloc(sizeof(clip[clipnum].sample[0]) * capacity);
+	if (clip[clipnum].sample == NULL) {
+		rc = -1;
+	} else {
+		clip[clipnum].capacity = capacity;
+		clip[clipnum].streaming = 1;
+	}
+	pthread_mutex_unlock(&clip_mutex);
+	return rc;
+}
+
+int wwviaudio_append_stream_clip(int clipnum, const double *sample, int nsamples)
+{
+	struct sound_clip *c;
+	int i, n, rc = 0;
+
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+
+	pthread_mutex_lock(&clip_mutex);
+	c = &clip[clipnum];
+	n = c->nsamples;
+	if (!c->streaming || n + nsamples > c->capacity) {
+		rc = -1;
+		goto out;
+	}
+	/* the callback only reads below nsamples, so these can be filled in
+	 * while it plays the clip, then published with one store
+	 */
+	for (i = 0; i < nsamples; i++)
+		c->sample[n + i] = (int16_t) (sample[i] * 32767.0);
+	__atomic_store_n(&c->nsamples, n + nsamples, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&clip_mutex);
+	return rc;
+}
+
+int wwviaudio_end_stream_clip(int clipnum, int nsamples)
+{
+	struct sound_clip *c;
+
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+
+	pthread_mutex_lock(&clip_mutex);
+	c = &clip[clipnum];
+	if (!c->streaming) {
+		pthread_mutex_unlock(&clip_mutex);
+		return -1;
+	}
+	if (nsamples >= 0 && nsamples < c->nsamples)
+		__atomic_store_n(&c->nsamples, nsamples, __ATOMIC_RELEASE);
+	__atomic_store_n(&c->streaming, 0, __ATOMIC_RELEASE);
+	account_clip(clipnum);
+	evict_clips(clipnum);
+	pthread_mutex_unlock(&clip_mutex);
+	return 0;
+}
+
+void wwviaudio_set_clip_memory_budget(size_t bytes)
+{
+	pthread_mutex_lock(&clip_mutex);
+	clip_memory_budget = bytes;
+	if (clip)
+		evict_clips(-1);
+	pthread_mutex_unlock(&clip_mutex);
+}
+
+size_t wwviaudio_get_clip_memory(void)
+{
+	return clip_memory_used;
+}
+
+static void compute_reverb_gains(void)
+{
+	int i;
+
+	for (i = 0; i < REVERB_LINES; i++)
+		reverb[i].gain = powf(10.0, -3.0 * (float) reverb[i].length /
+					(reverb_decay * (float) output_rate));
+	reverb_tail_frames = (int) (reverb_decay * output_rate);
+}
+
+static void free_reverb(void)
+{
+	int i;
+
+	for (i = 0; i < REVERB_LINES; i++) {
+		if (reverb[i].buffer)
+			free(reverb[i].buffer);
+		reverb[i].buffer = NULL;
+	}
+}
+
+static int allocate_reverb(void)
+{
+	int i;
+
+	for (i = 0; i < REVERB_LINES; i++) {
+		/* line lengths are tuned for 44.1kHz */
+		reverb[i].length = (int) ((double) reverb_line_length[i] *
+					output_rate / WWVIAUDIO_SAMPLE_RATE);
+		reverb[i].pos = 0;
+		reverb[i].lp = 0.0;
+		reverb[i].buffer = malloc(sizeof(reverb[i].buffer[0]) * reverb[i].length);
+		if (reverb[i].buffer == NULL) {
+			free_reverb();
+			return -1;
+		}
+		memset(reverb[i].buffer, 0, sizeof(reverb[i].buffer[0]) * reverb[i].length);
+	}
+	compute_reverb_gains();
+	reverb_idle_frames = reverb_tail_frames;
+	return 0;
+}
+
+/* Run the send bus through the feedback delay network and add the
+ * wet signal to out.  Once the bus has been silent for longer than the
+ * decay time the network is skipped entirely.
+ */
+static void process_reverb_bus(float *bus, float *left, float *right,
+	unsigned long frames)
+{
+	unsigned long i;
+	int j;
+	float y[REVERB_LINES], f[REVERB_LINES], damping, wet;
+
+	if (reverb_idle_frames >= reverb_tail_frames) {
+		for (i = 0; i < frames; i++)
+			if (bus[i] != 0.0)
+				break;
+		if (i == frames)
+			return;
+	}
+	damping = reverb_damping;
+
+	for (i = 0; i < frames; i++) {
+		if (bus[i] != 0.0)
+			reverb_idle_frames = 0;
+		else if (reverb_idle_frames < reverb_tail_frames)
+			reverb_idle_frames++;
+		for (j = 0; j < REVERB_LINES; j++) {
+			y[j] = reverb[j].buffer[reverb[j].pos];
+			reverb[j].lp = y[j] + damping * (reverb[j].lp - y[j]);
+			f[j] = reverb[j].lp * reverb[j].gain;
+		}
+		if (right) {
+			/* alternate lines feed each side, which decorrelates them */
+			left[i] += (y[0] + y[2]) * 0.35 * reverb_level;
+			right[i] += (y[1] + y[3]) * 0.35 * reverb_level;
+		} else {
+			wet = y[0] + y[1] + y[2] + y[3];
+			left[i] += wet * 0.25 * reverb_level;
+		}
+		/* 4x4 Hadamard feedback matrix, scaled to be orthonormal */
+		y[0] = 0.5 * (f[0] + f[1] + f[2] + f[3]);
+		y[1] = 0.5 * (f[0] - f[1] + f[2] - f[3]);
+		y[2] = 0.5 * (f[0] + f[1] - f[2] - f[3]);
+		y[3] = 0.5 * (f[0] - f[1] - f[2] + f[3]);
+		for (j = 0; j < REVERB_LINES; j++) {
+			reverb[j].buffer[reverb[j].pos] = bus[i] + y[j];
+			if (++reverb[j].pos >= reverb[j].length)
+				reverb[j].pos = 0;
+		}
+	}
+	if (reverb_idle_frames >= reverb_tail_frames) {
+		/* tail has died away, flush denormals and go idle */
+		for (j = 0; j < REVERB_LINES; j++) {
+			memset(reverb[j].buffer, 0,
+				sizeof(reverb[j].buffer[0]) * reverb[j].length);
+			reverb[j].lp = 0.0;
+		}
+	}
+}
+
+static int allocate_limiter(void)
+{
+	limiter_delay = malloc(sizeof(limiter_delay[0]) * LIMITER_LOOKAHEAD * 2);
+	if (limiter_delay == NULL)
+		return -1;
+	memset(limiter_delay, 0, sizeof(limiter_delay[0]) * LIMITER_LOOKAHEAD * 2);
+	limiter_pos = 0;
+	limiter_gain = 1.0;
+	limiter_floor = 1.0;
+	limiter_step = 0.0;
+	limiter_hold = 0;
+	limiter_release = 1.0 - expf(-1.0 /
+			(LIMITER_RELEASE_SECS * output_rate));
 	return 0;
 }
 
+static inline float clamp_sample(float y)
+{
+	/* belt and suspenders, should never trigger */
+	if (y > 1.0)
+		return 1.0;
+	if (y < -1.0)
+		return -1.0;
+	return y;
+}
+
+/* Limit left (and right, if not NULL) in place.  Each frame that would
+ * exceed the threshold sets a gain it needs, and the gain ramps linearly
+ * so it gets there by the time that frame leaves the delay line.  After
+ * the hold time it releases exponentially back to unity.  Stereo is
+ * linked, both sides get the same gain.
+ */
+static void limit_output(float *left, float *right, unsigned long frames)
+{
+	unsigned long i;
+	float x, xr = 0.0, peak, need, step, y;
+	float *delay_right = limiter_delay + LIMITER_LOOKAHEAD;
+
+	for (i = 0; i < frames; i++) {
+		x = left[i];
+		peak = fabsf(x);
+		if (right) {
+			xr = right[i];
+			if (fabsf(xr) > peak)
+				peak = fabsf(xr);
+		}
+		if (peak > LIMITER_THRESHOLD) {
+			need = LIMITER_THRESHOLD / peak;
+			if (need < limiter_floor)
+				limiter_floor = need;
+			step = (need - limiter_gain) / (float) LIMITER_LOOKAHEAD;
+			if (step < limiter_step)
+				limiter_step = step;
+			limiter_hold = 2 * LIMITER_LOOKAHEAD;
+		}
+
+		if (limiter_step < 0.0) {
+			limiter_gain += limiter_step;
+			if (limiter_gain <= limiter_floor) {
+				limiter_gain = limiter_floor;
+				limiter_step = 0.0;
+			}
+		} else if (limiter_hold > 0) {
+			limiter_hold--;
+		} else if (limiter_gain < 1.0) {
+			limiter_gain += (1.0 - limiter_gain) * limiter_release;
+			if (limiter_gain > 0.99999)
+				limiter_gain = 1.0;
+			limiter_floor = limiter_gain;
+		}
+
+		y = limiter_delay[limiter_pos] * limiter_gain;
+		limiter_delay[limiter_pos] = x;
+		left[i] = clamp_sample(y);
+		if (right) {
+			y = delay_right[limiter_pos] * limiter_gain;
+			delay_right[limiter_pos] = xr;
+			right[i] = clamp_sample(y);
+		}
+		if (++limiter_pos >= LIMITER_LOOKAHEAD)
+			limiter_pos = 0;
+	}
+}
+
+/* Returns the kth largest (k counts from 0) of the n values in a,
+ * reordering a in the process.
+ */
+static float kth_largest(float *a, int n, int k)
+{
+	int lo = 0, hi = n - 1, i, j;
+	float pivot, t;
+
+	while (lo < hi) {
+		pivot = a[(lo + hi) / 2];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (a[i] > pivot)
+				i++;
+			while (a[j] < pivot)
+				j--;
+			if (i <= j) {
+				t = a[i];
+				a[i] = a[j];
+				a[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+	return a[k];
+}
+
+/* Work out how loud each active voice is, and from that, the audibility
+ * a voice must reach to be mixed this buffer.
+ */
+static float voice_cutoff(void)
+{
+	unsigned int j;
+	int naudible = 0;
+	float gain;
+
+	for (j = 0; j < max_concurrent_sounds; j++) {
+		voice_audibility[j] = 0.0;
+		if (audio_queue[j].state != VOICE_ACTIVE ||
+			audio_queue[j].sample == NULL)
+			continue;
+		if (j != WWVIAUDIO_MUSIC_SLOT)
+			gain = sound_effects_on ? 1.0 : 0.0;
+		else
+			gain = music_playing ? 1.0 : 0.0;
+		gain *= audio_queue[j].volume;
+		voice_audibility[j] = gain;
+		if (gain >= audibility_threshold)
+			audibility_scratch[naudible++] = gain;
+	}
+	if (max_real_voices == 0 || naudible <= (int) max_real_voices)
+		return audibility_threshold;
+	return kth_largest(audibility_scratch, naudible, max_real_voices - 1);
+}
+
+/* Start, stop and adjust voices as told by the producers. */
+static void run_commands(void)
+{
+	unsigned int head, tail;
+	unsigned int j;
+	struct audio_command *c;
+	struct voice *v;
+
+	head = __atomic_load_n(&command_head, __ATOMIC_ACQUIRE);
+	for (tail = command_tail; tail != head; tail++) {
+		c = &command_ring[tail & (COMMAND_RING_SIZE - 1)];
+		v = &audio_queue[c->slot];
+		switch (c->type) {
+		case CMD_START:
+			__atomic_store_n(&v->sample, c->sample, __ATOMIC_RELEASE);
+			v->nsamples = c->nsamples;
+			v->stream = c->stream;
+			v->pos = -c->offset;
+			if (c->timed) {
+				/* add_sounds() keeps this within WWVIAUDIO_MAX_AHEAD */
+				if (c->when > stream_frame)
+					v->pos -= (int) (c->when - stream_frame);
+				else if (stream_frame - c->when < (uint64_t) c->offset)
+					v->pos += (int) (stream_frame - c->when);
+				else
+					v->pos = 0; /* late, start right away */
+			}
+			v->volume = c->volume;
+			v->pan = c->pan;
+			v->reverb_send = c->reverb_send;
+			__atomic_store_n(&v->state, VOICE_ACTIVE, __ATOMIC_RELEASE);
+			break;
+		case CMD_CANCEL:
+			if (v->state == VOICE_ACTIVE)
+				__atomic_store_n(&v->state, VOICE_FREE, __ATOMIC_RELEASE);
+			break;
+		case CMD_CANCEL_ALL:
+			for (j = 0; j < max_concurrent_sounds; j++)
+				if (audio_queue[j].state == VOICE_ACTIVE)
+					__atomic_store_n(&audio_queue[j].state,
+						VOICE_FREE, __ATOMIC_RELEASE);
+			break;
+		case CMD_SET_VOLUME:
+			v->volume = c->volume;
+			break;
+		case CMD_SET_PAN:
+			v->pan = c->volume;
+			break;
+		case CMD_SET_REVERB_SEND:
+			v->reverb_send = c->volume;
+			break;
+		case CMD_SET_REVERB:
+			reverb_decay = c->volume;
+			reverb_damping = c->pan;
+			reverb_level = c->reverb_send;
+			compute_reverb_gains();
+			break;
+		}
+	}
+	__atomic_store_n(&command_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Mix every real voice into mixbuf, mixbuf_right (dry) and reverb_bus
+ * (send), and advance every active voice, real or virtual, by frames.
+ * Voices that have not reached their first frame yet contribute silence.
+ */
+static void mix_voices(unsigned long frames)
+{
+	unsigned int j, nreal = 0, nvirtual = 0;
+	int i, start, end, streaming;
+	float gain, gain_right = 0.0, send, cutoff, angle;
+	struct voice *v;
+
+	memset(mixbuf, 0, sizeof(mixbuf[0]) * frames);
+	if (mixbuf_right)
+		memset(mixbuf_right, 0, sizeof(mixbuf_right[0]) * frames);
+	memset(reverb_bus, 0, sizeof(reverb_bus[0]) * frames);
+
+	cutoff = voice_cutoff();
+	if (cutoff < audibility_threshold)
+		cutoff = audibility_threshold;
+
+	for (j = 0; j < max_concurrent_sounds; j++) {
+		v = &audio_queue[j];
+		if (v->state != VOICE_ACTIVE || v->sample == NULL)
+			continue;
+		streaming = 0;
+		if (v->stream) {
+			/* play as much as has been appended so far */
+			streaming = __atomic_load_n(&v->stream->streaming, __ATOMIC_ACQUIRE);
+			v->nsamples = __atomic_load_n(&v->stream->nsamples, __ATOMIC_ACQUIRE);
+			if (!streaming)
+				v->stream = NULL;
+		}
+		gain = voice_audibility[j];
+		if (gain < cutoff || (max_real_voices && nreal >= max_real_voices)) {
+			nvirtual++;
+			goto advance;
+		}
+		nreal++;
+		gain = gain / (float) (INT16_MAX);
+		send = v->reverb_send;
+		if (mixbuf_right) {
+			/* equal power pan */
+			angle = (v->pan + 1.0) * (float) M_PI / 4.0;
+			gain_right = gain * sinf(angle);
+			gain = gain * cosf(angle);
+		}
+
+		start = v->pos < 0 ? -v->pos : 0;
+		end = v->nsamples - v->pos;
+		if (end > (int) frames)
+			end = (int) frames;
+		if (mixbuf_right) {
+			for (i = start; i < end; i++) {
+				float x = (float) v->sample[v->pos + i];
+				mixbuf[i] += x * gain;
+				mixbuf_right[i] += x * gain_right;
+				reverb_bus[i] += x * (gain + gain_right) * 0.5 * send;
+			}
+		} else if (send == 0.0) {
+			for (i = start; i < end; i++)
+				mixbuf[i] += (float) v->sample[v->pos + i] * gain;
+		} else {
+			for (i = start; i < end; i++) {
+				float x = (float) v->sample[v->pos + i] * gain;
+				mixbuf[i] += x;
+				reverb_bus[i] += x * send;
+			}
+		}
+advance:
+		if (streaming && v->pos + (int) frames > v->nsamples) {
+			/* caught up with the stream; wait there for more */
+			if (v->nsamples > v->pos)
+				v->pos = v->nsamples;
+			continue;
+		}
+		v->pos += frames;
+		if (v->pos >= v->nsamples)
+			__atomic_store_n(&v->state, VOICE_FREE, __ATOMIC_RELEASE);
+	}
+	real_voice_count = nreal;
+	virtual_voice_count = nvirtual;
+}
+
 /* This routine will be called by the PortAudio engine when audio is needed.
 ** It may called at interrupt level on some machines so don't do anything
 ** that could mess up the system like calling malloc() or free().
@@ -201,50 +1089,44 @@ static int patestCallback(__attribute__ ((unused)) const void *inputBuffer,
 	__attribute__ ((unused)) PaStreamCallbackFlags statusFlags,
 	__attribute__ ((unused)) void *userData )
 {
-	unsigned int i, j;
-	int sample, count;
+	unsigned long i, frames;
+	unsigned long total_frames = framesPerBuffer;
 	float *out = NULL;
-	float output;
 	out = (float*) outputBuffer;
-	output = 0.0;
-	count = 0;
+
+	PROBE2(wwviaudio, mix__start, stream_frame, total_frames);
+	run_commands();
 
 	if (audio_paused) {
 		/* output silence when paused and
 		 * don't advance any sound slot pointers
 		 */
-		for (i = 0; i < framesPerBuffer; i++)
+		for (i = 0; i < framesPerBuffer * output_channels; i++)
 			*out++ = (float) 0;
+		PROBE2(wwviaudio, mix__done, stream_frame, total_frames);
 		return 0;
 	}
 
-	for (i = 0; i < framesPerBuffer; i++) {
-		output = 0.0;
-		count = 0;
-		for (j = 0; j < max_concurrent_sounds; j++) {
-			if (!audio_queue[j].active ||
-				audio_queue[j].sample == NULL)
-				continue;
-			sample = i + audio_queue[j].pos;
-			count++;
-			if (sample >= audio_queue[j].nsamples) {
-				audio_queue[j].active = 0;
-				continue;
+	while (framesPerBuffer > 0) {
+		frames = framesPerBuffer;
+		if (frames > mix_frames)
+			frames = mix_frames;
+		mix_voices(frames);
+		process_reverb_bus(reverb_bus, mixbuf, mixbuf_right, frames);
+		limit_output(mixbuf, mixbuf_right, frames);
+		if (mixbuf_right) {
+			for (i = 0; i < frames; i++) {
+				*out++ = mixbuf[i];
+				*out++ = mixbuf_right[i];
 			}
-			if (j != WWVIAUDIO_MUSIC_SLOT && sound_effects_on)
-				output += (float) audio_queue[j].sample[sample] * 0.5 / (float) (INT16_MAX);
-			else if (j == WWVIAUDIO_MUSIC_SLOT && music_playing)
-				output += (float) audio_queue[j].sample[sample] / (float) (INT16_MAX);
+		} else {
+			memcpy(out, mixbuf, sizeof(*out) * frames);
+			out += frames;
 		}
-		*out++ = (float) output / 2.0;
-        }
-	for (i = 0; i < max_concurrent_sounds; i++) {
-		if (!audio_queue[i].active)
-			continue;
-		audio_queue[i].pos += framesPerBuffer;
-		if (audio_queue[i].pos >= audio_queue[i].nsamples)
-			audio_queue[i].active = 0;
+		framesPerBuffer -= frames;
+		__atomic_store_n(&stream_frame, stream_frame + frames, __ATOMIC_RELEASE);
 	}
+	PROBE2(wwviaudio, mix__done, stream_frame, total_frames);
 	return 0; /* we're never finished */
 }
 
@@ -278,8 +1160,22 @@ int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds, int maximum_so
 
 	audio_queue = malloc(max_concurrent_sounds * sizeof(audio_queue[0]));
 	clip = malloc(max_sound_clips * sizeof(clip[0]));
-	if (audio_queue == NULL || clip == NULL)
+	mix_frames = frames_per_buffer ? frames_per_buffer : FRAMES_PER_BUFFER;
+	mixbuf = malloc(mix_frames * sizeof(mixbuf[0]));
+	if (output_channels == 2)
+		mixbuf_right = malloc(mix_frames * sizeof(mixbuf_right[0]));
+	reverb_bus = malloc(mix_frames * sizeof(reverb_bus[0]));
+	command_ring = malloc(COMMAND_RING_SIZE * sizeof(command_ring[0]));
+	voice_audibility = malloc(max_concurrent_sounds * sizeof(voice_audibility[0]));
+	audibility_scratch = malloc(max_concurrent_sounds * sizeof(audibility_scratch[0]));
+	if (audio_queue == NULL || clip == NULL ||
+		mixbuf == NULL || reverb_bus == NULL || command_ring == NULL ||
+		(output_channels == 2 && mixbuf_right == NULL) ||
+		voice_audibility == NULL || audibility_scratch == NULL)
 		return -1;
+	command_head = 0;
+	command_tail = 0;
+	stream_frame = 0;
 
 	memset(audio_queue, 0, sizeof(audio_queue[0]) * max_concurrent_sounds);
 	memset(clip, 0, sizeof(clip[0]) * max_sound_clips);
@@ -321,16 +1217,34 @@ int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds, int maximum_so
 		return -1;
 	}
 
-	outparams.channelCount = 1;                      /* mono output */
+	/* Running at the device's own rate saves the OS resampling our
+	 * output; clips are converted to whatever rate we pick as they load.
+	 */
+	if (requested_sample_rate > 0)
+		output_rate = requested_sample_rate;
+	else
+		output_rate = (int) Pa_GetDeviceInfo(outparams.device)->defaultSampleRate;
+	if (output_rate <= 0)
+		output_rate = WWVIAUDIO_SAMPLE_RATE;
+	if (allocate_reverb() != 0 || allocate_limiter() != 0) {
+		sound_working = 0;
+		return -1;
+	}
+
+	outparams.channelCount = output_channels;        /* mono or stereo output */
 	outparams.sampleFormat = paFloat32;              /* 32 bit floating point output */
-	outparams.suggestedLatency =
-		Pa_GetDeviceInfo(outparams.device)->defaultLowOutputLatency;
+	if (suggested_latency > 0.0)
+		outparams.suggestedLatency = suggested_latency;
+	else
+		outparams.suggestedLatency =
+			Pa_GetDeviceInfo(outparams.device)->defaultLowOutputLatency;
 	outparams.hostApiSpecificStreamInfo = NULL;
 
 	rc = Pa_OpenStream(&stream,
 		NULL,         /* no input */
-		&outparams, WWVIAUDIO_SAMPLE_RATE, FRAMES_PER_BUFFER,
-		paNoFlag, /* paClipOff, */   /* we won't output out of range samples so don't bother clipping them */
+		&outparams, output_rate,
+		frames_per_buffer ? frames_per_buffer : paFramesPerBufferUnspecified,
+		paClipOff,   /* the limiter keeps samples in range so don't bother clipping them */
 		patestCallback, NULL /* cookie */);
 	if (rc != paNoError)
 		goto error;
@@ -363,17 +1277,209 @@ error:
 		for (i = 0; i < max_sound_clips; i++) {
 			if (clip[i].sample)
 				free(clip[i].sample);
+			if (clip[i].filename)
+				free(clip[i].filename);
 		}
+		clip_memory_used = 0;
 		free(clip);
 		clip = NULL;
 		max_sound_clips = 0;
 	}
+	if (mixbuf) {
+		free(mixbuf);
+		mixbuf = NULL;
+	}
+	if (mixbuf_right) {
+		free(mixbuf_right);
+		mixbuf_right = NULL;
+	}
+	if (command_ring) {
+		free(command_ring);
+		command_ring = NULL;
+	}
+	if (reverb_bus) {
+		free(reverb_bus);
+		reverb_bus = NULL;
+	}
+	if (voice_audibility) {
+		free(voice_audibility);
+		voice_audibility = NULL;
+	}
+	if (audibility_scratch) {
+		free(audibility_scratch);
+		audibility_scratch = NULL;
+	}
+	free_reverb();
+	if (limiter_delay) {
+		free(limiter_delay);
+		limiter_delay = NULL;
+	}
 	return;
 }
 
-static int wwviaudio_add_sound_to_slot(int which_sound, int which_slot)
+/* Room left in the command ring.  Called with submit_mutex held. */
+static unsigned int command_space(void)
+{
+	return COMMAND_RING_SIZE -
+		(command_head - __atomic_load_n(&command_tail, __ATOMIC_ACQUIRE));
+}
+
+/* The ith unpublished command.  Called with submit_mutex held. */
+static struct audio_command *next_command(unsigned int i)
+{
+	return &command_ring[(command_head + i) & (COMMAND_RING_SIZE - 1)];
+}
+
+/* Hand n commands to the callback in one go.  Called with submit_mutex held. */
+static void publish_commands(unsigned int n)
+{
+	__atomic_store_n(&command_head, command_head + n, __ATOMIC_RELEASE);
+}
+
+/* Claim a free non-music channel.  Called with submit_mutex held. */
+static int reserve_voice(void)
+{
+	unsigned int i;
+	int expected;
+
+	for (i = 1; i < max_concurrent_sounds; i++) {
+		expected = VOICE_FREE;
+		if (__atomic_compare_exchange_n(&audio_queue[i].state, &expected,
+				VOICE_RESERVED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return (int) i;
+	}
+	return -1;
+}
+
+static void unreserve_voice(int slot)
+{
+	__atomic_store_n(&audio_queue[slot].state, VOICE_FREE, __ATOMIC_RELEASE);
+}
+
+static int free_voice_count(int enough)
 {
 	unsigned int i;
+	int count = 0;
+
+	for (i = 1; i < max_concurrent_sounds && count < enough; i++)
+		if (__atomic_load_n(&audio_queue[i].state, __ATOMIC_ACQUIRE) == VOICE_FREE)
+			count++;
+	return count;
+}
+
+static void fill_start_command(struct audio_command *c, int slot,
+	struct wwviaudio_sound_start *start, int timed, uint64_t when)
+{
+	c->type = CMD_START;
+	c->slot = slot;
+	c->timed = timed;
+	c->when = when;
+	c->sample = clip[start->sound_number].sample;
+	c->nsamples = clip[start->sound_number].nsamples;
+	c->stream = clip[start->sound_number].streaming ? &clip[start->sound_number] : NULL;
+	c->offset = start->offset < 0 ? 0 : start->offset;
+	c->volume = start->volume < 0.0 ? 0.0 : start->volume;
+	c->pan = start->pan;
+	if (c->pan < -1.0)
+		c->pan = -1.0;
+	if (c->pan > 1.0)
+		c->pan = 1.0;
+	c->reverb_send = start->reverb_send;
+	if (c->reverb_send < 0.0)
+		c->reverb_send = 0.0;
+	if (c->reverb_send > 1.0)
+		c->reverb_send = 1.0;
+	audio_queue[slot].pending_sample = c->sample;
+}
+
+static int add_sounds(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels, int timed, uint64_t when)
+{
+	uint64_t now;
+	int i, slot;
+
+	if (!sound_working || nsounds <= 0)
+		return -1;
+	for (i = 0; i < nsounds; i++)
+		if (start[i].sound_number < 0 ||
+			start[i].sound_number >= max_sound_clips)
+			return -1;
+	/* so that the callback's frame arithmetic stays within an int */
+	now = wwviaudio_get_time();
+	if (timed && when > now) {
+		for (i = 0; i < nsounds; i++)
+			if (when - now + (start[i].offset > 0 ? start[i].offset : 0) >
+					(uint64_t) WWVIAUDIO_MAX_AHEAD)
+				return -1;
+	}
+
+	pthread_mutex_lock(&clip_mutex);
+	for (i = 0; i < nsounds; i++)
+		if (prepare_clip(start[i].sound_number) != 0)
+			goto fail_clip;
+	pthread_mutex_lock(&submit_mutex);
+	if (command_space() < (unsigned int) nsounds)
+		goto fail;
+	for (i = 0; i < nsounds; i++) {
+		slot = reserve_voice();
+		if (slot < 0) {
+			while (--i >= 0)
+				unreserve_voice(next_command(i)->slot);
+			goto fail;
+		}
+		fill_start_command(next_command(i), slot, &start[i], timed, when);
+		if (channels)
+			channels[i] = slot;
+	}
+	publish_commands(nsounds);
+	pthread_mutex_unlock(&submit_mutex);
+	evict_clips(-1);
+	pthread_mutex_unlock(&clip_mutex);
+	return 0;
+fail:
+	pthread_mutex_unlock(&submit_mutex);
+fail_clip:
+	pthread_mutex_unlock(&clip_mutex);
+	return -1;
+}
+
+int wwviaudio_add_sounds(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels)
+{
+	return add_sounds(start, nsounds, channels, 0, 0);
+}
+
+int wwviaudio_add_sounds_at(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels, uint64_t when)
+{
+	return add_sounds(start, nsounds, channels, 1, when);
+}
+
+int wwviaudio_add_sound_at(int which_sound, uint64_t when)
+{
+	struct wwviaudio_sound_start start;
+	int channel;
+
+	start.sound_number = which_sound;
+	start.volume = 1.0;
+	start.pan = 0.0;
+	start.offset = 0;
+	start.reverb_send = 0.0;
+	if (add_sounds(&start, 1, &channel, 1, when) != 0)
+		return -1;
+	return channel;
+}
+
+uint64_t wwviaudio_get_time(void)
+{
+	return __atomic_load_n(&stream_frame, __ATOMIC_ACQUIRE);
+}
+
+static int wwviaudio_add_sound_to_slot(int which_sound, int which_slot,
+	int min_free_slots, float send)
+{
+	struct wwviaudio_sound_start start;
+	int slot;
 
 	if (!sound_working)
 		return 0;
@@ -381,80 +1487,82 @@ static int wwviaudio_add_sound_to_slot(int which_sound, int which_slot)
 	if (nomusic && which_slot == WWVIAUDIO_MUSIC_SLOT)
 		return 0;
 
+	if (which_sound < 0 || which_sound >= max_sound_clips)
+		return -1;
+
+	start.sound_number = which_sound;
+	start.volume = 1.0;
+	start.pan = 0.0;
+	start.offset = 0;
+	start.reverb_send = send;
+
+	pthread_mutex_lock(&clip_mutex);
+	if (prepare_clip(which_sound) != 0)
+		goto fail_clip;
+	pthread_mutex_lock(&submit_mutex);
+	if (command_space() < 1)
+		goto fail;
 	if (which_slot != WWVIAUDIO_ANY_SLOT) {
-		if (audio_queue[which_slot].active)
-			audio_queue[which_slot].active = 0;
-		audio_queue[which_slot].pos = 0;
-		audio_queue[which_slot].nsamples = 0;
-		/* would like to put a memory barrier here. */
-		audio_queue[which_slot].sample = clip[which_sound].sample;
-		audio_queue[which_slot].nsamples = clip[which_sound].nsamples;
-		/* would like to put a memory barrier here. */
-		audio_queue[which_slot].active = 1;
-		return which_slot;
-	}
-	for (i=1;i<max_concurrent_sounds;i++) {
-		if (audio_queue[i].active == 0) {
-			audio_queue[i].nsamples = clip[which_sound].nsamples;
-			audio_queue[i].pos = 0;
-			audio_queue[i].sample = clip[which_sound].sample;
-			audio_queue[i].active = 1;
-			break;
-		}
+		slot = which_slot;
+		__atomic_store_n(&audio_queue[slot].state, VOICE_RESERVED,
+					__ATOMIC_RELEASE);
+	} else {
+		if (min_free_slots && free_voice_count(min_free_slots) < min_free_slots)
+			goto fail;
+		slot = reserve_voice();
+		if (slot < 0)
+			goto fail;
 	}
-	return (i >= max_concurrent_sounds) ? -1 : (int) i;
+	fill_start_command(next_command(0), slot, &start, 0, 0);
+	publish_commands(1);
+	pthread_mutex_unlock(&submit_mutex);
+	evict_clips(-1);
+	pthread_mutex_unlock(&clip_mutex);
+	return slot;
+fail:
+	pthread_mutex_unlock(&submit_mutex);
+fail_clip:
+	pthread_mutex_unlock(&clip_mutex);
+	return -1;
 }
 
 int wwviaudio_add_sound(int which_sound)
 {
-	return wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_ANY_SLOT);
+	return wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_ANY_SLOT, 0, 0.0);
 }
 
 int wwviaudio_play_music(int which_sound)
 {
-	return wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_MUSIC_SLOT);
+	return wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_MUSIC_SLOT, 0, 0.0);
 }
 
 
 void wwviaudio_add_sound_low_priority(int which_sound)
 {
-
 	/* adds a sound if there are at least 5 empty sound slots. */
-	unsigned int i;
-	int empty_slots = 0;
-	int last_slot;
+	wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_ANY_SLOT, 5, 0.0);
+}
 
-	if (!sound_working)
-		return;
-	last_slot = -1;
-	for (i = 1; i < max_concurrent_sounds; i++)
-		if (audio_queue[i].active == 0) {
-			last_slot = i;
-			empty_slots++;
-			if (empty_slots >= 5)
-				break;
-	}
+static void send_command(int type, int slot, float value)
+{
+	struct audio_command *c;
 
-	if (empty_slots < 5)
+	if (!sound_working || slot < 0 || slot >= (int) max_concurrent_sounds)
 		return;
-	
-	i = (unsigned int) last_slot;
-
-	if (audio_queue[i].active == 0) {
-		audio_queue[i].nsamples = clip[which_sound].nsamples;
-		audio_queue[i].pos = 0;
-		audio_queue[i].sample = clip[which_sound].sample;
-		audio_queue[i].active = 1;
+	pthread_mutex_lock(&submit_mutex);
+	if (command_space() > 0) {
+		c = next_command(0);
+		c->type = type;
+		c->slot = slot;
+		c->volume = value;
+		publish_commands(1);
 	}
-	return;
+	pthread_mutex_unlock(&submit_mutex);
 }
 
-
 void wwviaudio_cancel_sound(int queue_entry)
 {
-	if (!sound_working)
-		return;
-	audio_queue[queue_entry].active = 0;
+	send_command(CMD_CANCEL, queue_entry, 0.0);
 }
 
 void wwviaudio_cancel_music(void)
@@ -464,11 +1572,16 @@ void wwviaudio_cancel_music(void)
 
 void wwviaudio_cancel_all_sounds(void)
 {
-	unsigned int i;
-	if (!sound_working)
-		return;
-	for (i = 0; i < max_concurrent_sounds; i++)
-		audio_queue[i].active = 0;
+	send_command(CMD_CANCEL_ALL, 0, 0.0);
+}
+
+void wwviaudio_set_sound_pan(int channel, float pan)
+{
+	if (pan < -1.0)
+		pan = -1.0;
+	if (pan > 1.0)
+		pan = 1.0;
+	send_command(CMD_SET_PAN, channel, pan);
 }
 
 int wwviaudio_set_sound_device(int device)
@@ -477,12 +1590,100 @@ int wwviaudio_set_sound_device(int device)
 	return 0;
 }
 
+void wwviaudio_set_reverb_send(int channel, float level)
+{
+	if (level < 0.0)
+		level = 0.0;
+	if (level > 1.0)
+		level = 1.0;
+	send_command(CMD_SET_REVERB_SEND, channel, level);
+}
+
+int wwviaudio_add_sound_with_reverb(int which_sound, float send)
+{
+	/* the send goes in with the start, so the attack isn't mixed dry */
+	return wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_ANY_SLOT, 0, send);
+}
+
+int wwviaudio_clip_in_use(int clipnum)
+{
+	int rc;
+
+	if (!sound_working || clipnum >= max_sound_clips || clipnum < 0)
+		return 0;
+	pthread_mutex_lock(&clip_mutex);
+	rc = clip_in_use(clipnum);
+	pthread_mutex_unlock(&clip_mutex);
+	return rc;
+}
+
+void wwviaudio_set_sound_volume(int channel, float volume)
+{
+	if (volume < 0.0)
+		volume = 0.0;
+	send_command(CMD_SET_VOLUME, channel, volume);
+}
+
+void wwviaudio_set_audibility_threshold(float threshold)
+{
+	audibility_threshold = threshold;
+}
+
+void wwviaudio_set_max_real_voices(int nvoices)
+{
+	max_real_voices = nvoices < 0 ? 0 : (unsigned int) nvoices;
+}
+
+void wwviaudio_get_voice_counts(int *real, int *virtual)
+{
+	if (real)
+		*real = real_voice_count;
+	if (virtual)
+		*virtual = virtual_voice_count;
+}
+
+void wwviaudio_set_reverb(float decay_seconds, float damping, float level)
+{
+	struct audio_command *c;
+
+	if (decay_seconds < 0.05)
+		decay_seconds = 0.05;
+	if (damping < 0.0)
+		damping = 0.0;
+	if (damping > 0.95)
+		damping = 0.95;
+	pthread_mutex_lock(&submit_mutex);
+	if (!sound_working) {
+		/* no callback to race with; the gains are worked out at start */
+		reverb_decay = decay_seconds;
+		reverb_damping = damping;
+		reverb_level = level;
+	} else if (command_space() > 0) {
+		/* all three change together, between buffers */
+		c = next_command(0);
+		c->type = CMD_SET_REVERB;
+		c->slot = 0;
+		c->volume = decay_seconds;
+		c->pan = damping;
+		c->reverb_send = level;
+		publish_commands(1);
+	}
+	pthread_mutex_unlock(&submit_mutex);
+}
+
 #else /* stubs only... */
 
-int wwviaudio_initialize_portaudio() { return 0; }
+int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds,
+	int maximum_sound_clips) { return 0; }
 void wwviaudio_stop_portaudio() { return; }
 void wwviaudio_set_nomusic() { return; }
 int wwviaudio_read_ogg_clip(int clipnum, char *filename) { return 0; }
+int wwviaudio_register_ogg_clip(int clipnum, char *filename) { return 0; }
+void wwviaudio_set_clip_memory_budget(size_t bytes) { return; }
+int wwviaudio_begin_stream_clip(int clipnum, int capacity) { return -1; }
+int wwviaudio_append_stream_clip(int clipnum, const double *sample, int nsamples) { return -1; }
+int wwviaudio_end_stream_clip(int clipnum, int nsamples) { return -1; }
+size_t wwviaudio_get_clip_memory(void) { return 0; }
 
 void wwviaudio_pause_audio() { return; }
 void wwviaudio_resume_audio() { return; }
@@ -501,5 +1702,31 @@ void wwviaudio_add_sound_low_priority(int which_sound) { return; }
 void wwviaudio_cancel_sound(int queue_entry) { return; }
 void wwviaudio_cancel_all_sounds() { return; }
 int wwviaudio_set_sound_device(int device) { return 0; }
+void wwviaudio_set_reverb_send(int channel, float level) { return; }
+int wwviaudio_add_sound_with_reverb(int which_sound, float send) { return 0; }
+void wwviaudio_set_reverb(float decay_seconds, float damping, float level) { return; }
+int wwviaudio_clip_in_use(int clipnum) { return 0; }
+void wwviaudio_set_sound_volume(int channel, float volume) { return; }
+int wwviaudio_set_output_channels(int channels) { return 0; }
+int wwviaudio_add_sounds(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels) { return 0; }
+void wwviaudio_set_sound_pan(int channel, float pan) { return; }
+int wwviaudio_set_buffer_size(int frames) { return 0; }
+int wwviaudio_set_sample_rate(int rate) { return 0; }
+int wwviaudio_get_sample_rate(void) { return WWVIAUDIO_SAMPLE_RATE; }
+void wwviaudio_set_latency(double seconds) { return; }
+int wwviaudio_add_sounds_at(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels, uint64_t when) { return 0; }
+int wwviaudio_add_sound_at(int which_sound, uint64_t when) { return 0; }
+uint64_t wwviaudio_get_time(void) { return 0; }
+void wwviaudio_set_audibility_threshold(float threshold) { return; }
+void wwviaudio_set_max_real_voices(int nvoices) { return; }
+void wwviaudio_get_voice_counts(int *real, int *virtual)
+{
+	if (real)
+		*real = 0;
+	if (virtual)
+		*virtual = 0;
+}
 
 #endif
@@ -21,6 +21,9 @@
 
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef WWVIAUDIO_DEFINE_GLOBALS
 #define GLOBAL
 #else
@@ -30,6 +33,7 @@
 #define WWVIAUDIO_MUSIC_SLOT (0)
 #define WWVIAUDIO_SAMPLE_RATE   (44100)
 #define WWVIAUDIO_ANY_SLOT (-1)
+#define WWVIAUDIO_MAX_AHEAD (1 << 30)	/* frames a sound can be scheduled ahead */
 
 /*
  *             Configuration functions.
@@ -39,6 +43,38 @@
  */
 GLOBAL void wwviaudio_set_nomusic(void);
 
+/* Set the number of output channels, 1 (mono, the default) or 2 (stereo).
+ * Sounds are panned into the stereo field, see wwviaudio_set_sound_pan.
+ * Meant to be called prior to wwviaudio_initialize_portaudio.
+ * 0 is returned on success, -1 otherwise.
+ */
+GLOBAL int wwviaudio_set_output_channels(int channels);
+
+/* Set the number of frames per audio buffer.  The default is 1024
+ * (~23ms at 44.1kHz).  Smaller buffers lower latency but cost more
+ * callbacks; 0 lets portaudio choose, and vary, the size.
+ * Meant to be called prior to wwviaudio_initialize_portaudio.
+ * 0 is returned on success, -1 otherwise.
+ */
+GLOBAL int wwviaudio_set_buffer_size(int frames);
+
+/* Set the output sample rate.  The default is WWVIAUDIO_SAMPLE_RATE;
+ * 0 means use the device's native rate, which avoids the OS resampling
+ * our output.  Clips are converted to this rate as they are loaded.
+ * Meant to be called prior to wwviaudio_initialize_portaudio.
+ * 0 is returned on success, -1 otherwise.
+ */
+GLOBAL int wwviaudio_set_sample_rate(int rate);
+
+/* The sample rate the output stream runs at, and the mixer clock ticks at. */
+GLOBAL int wwviaudio_get_sample_rate(void);
+
+/* Set the output latency, in seconds, suggested to portaudio.  The
+ * default (0.0) uses the device's default low latency.
+ * Meant to be called prior to wwviaudio_initialize_portaudio.
+ */
+GLOBAL void wwviaudio_set_latency(double seconds);
+
 /* Set the audio device number to the given value
  * This is meant to be called prior to calling
  * wwviaudio_initialize_portaudio.  If you don't use
@@ -71,13 +107,53 @@ GLOBAL void wwviaudio_stop_portaudio(void);
 /* Read and decode an ogg vorbis audio file into a numbered buffer
  * The sound_number parameter is used later with wwviaudio_play_music and
  * wwviaudio_add_sound.  0 is returned on success, -1 otherwise.
- * Audio files should be 44100Hz, MONO.  The sound number is one you
- * provide which will then be associated with that sound.
+ * Audio files of any sample rate and channel count may be used, they are
+ * mixed down to mono and converted to the output sample rate as they are
+ * read.  The sound number is one you provide which will then be
+ * associated with that sound.
  */
 GLOBAL int wwviaudio_read_ogg_clip(int sound_number, char *filename);
 
+/* Associate an ogg vorbis file with a numbered buffer without reading it.
+ * The file is read the first time the sound is played.  0 is returned on
+ * success (the file exists), -1 otherwise.
+ */
+GLOBAL int wwviaudio_register_ogg_clip(int sound_number, char *filename);
+
+/* Limit the memory used by decoded clips to roughly the given number of
+ * bytes (0, the default, means no limit).  When over budget, clips read
+ * from files which are not playing are dropped, least recently played
+ * first, and read back in when next played.  Clips supplied with
+ * wwviaudio_use_double_clip are counted but never dropped.
+ */
+GLOBAL void wwviaudio_set_clip_memory_budget(size_t bytes);
+
+/* Bytes of decoded clip data currently held. */
+GLOBAL size_t wwviaudio_get_clip_memory(void);
+
+/* Use nsamples of mono WWVIAUDIO_SAMPLE_RATE audio, in -1.0 .. 1.0, as
+ * a numbered buffer.  The data is copied (and converted).
+ */
 GLOBAL int wwviaudio_use_double_clip(int sound_number, double *sample, int nsamples);
 
+/* A numbered buffer for audio which is still being made, with room for
+ * capacity frames of mono WWVIAUDIO_SAMPLE_RATE audio, appended (copied
+ * and converted) as it is made.  It can be played from the start; a
+ * channel which catches up with what has been appended waits for more
+ * rather than ending, until wwviaudio_end_stream_clip() says no more is
+ * coming, when it may also be cut short to nsamples (-1: as it is).
+ * Returns -1 if the output is not at WWVIAUDIO_SAMPLE_RATE, or the
+ * clip would overflow; use wwviaudio_use_double_clip() instead.
+ */
+GLOBAL int wwviaudio_begin_stream_clip(int sound_number, int capacity);
+GLOBAL int wwviaudio_append_stream_clip(int sound_number, const double *sample, int nsamples);
+GLOBAL int wwviaudio_end_stream_clip(int sound_number, int nsamples);
+
+/* Returns 1 if any channel is currently playing the numbered clip, 0 otherwise.
+ * A clip should not be replaced while it is in use.
+ */
+GLOBAL int wwviaudio_clip_in_use(int sound_number);
+
 /*
  *             Global sound control functions.
  */
@@ -125,6 +201,48 @@ GLOBAL /* channel */ int wwviaudio_add_sound(int sound_number);
  */
 GLOBAL void wwviaudio_add_sound_low_priority(int sound_number);
 
+/* One sound in a batch started by wwviaudio_add_sounds. */
+struct wwviaudio_sound_start {
+	int sound_number;	/* as passed to wwviaudio_read_ogg_clip() */
+	float volume;		/* 0.0 - 1.0 */
+	float pan;		/* -1.0 (left) - 1.0 (right), ignored for mono */
+	int offset;		/* frames to wait before starting, counted from
+				 * the start of the buffer the batch lands in */
+	float reverb_send;	/* 0.0 - 1.0, see wwviaudio_set_reverb_send() */
+};
+
+/* Start nsounds sounds at once.  Either all of them start, in the same
+ * audio buffer and sample aligned to their offsets, or none of them do.
+ * The channel of each sound is stored in channels[] if channels is not
+ * NULL.  0 is returned on success, -1 otherwise.
+ */
+GLOBAL int wwviaudio_add_sounds(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels);
+
+/* The mixer clock, in frames mixed since wwviaudio_initialize_portaudio.
+ * The clock stops while audio is paused.  It counts the first frame of
+ * the buffer the mixer will mix next, so sounds scheduled for that time or
+ * later start exactly on time.
+ */
+GLOBAL uint64_t wwviaudio_get_time(void);
+
+/* Like wwviaudio_add_sound, but the sound starts at the given mixer clock
+ * frame (see wwviaudio_get_time) rather than at the next buffer.  Sounds
+ * scheduled in the past start right away; sounds more than
+ * WWVIAUDIO_MAX_AHEAD frames (about 6.7 hours) ahead are refused.
+ */
+GLOBAL /* channel */ int wwviaudio_add_sound_at(int sound_number, uint64_t when);
+
+/* Like wwviaudio_add_sounds, but the offsets count from the given mixer
+ * clock frame.  Fails if any sound would start more than
+ * WWVIAUDIO_MAX_AHEAD frames ahead.
+ */
+GLOBAL int wwviaudio_add_sounds_at(struct wwviaudio_sound_start *start, int nsounds,
+	int *channels, uint64_t when);
+
+/* Move a channel within the stereo field, -1.0 (left) - 1.0 (right). */
+GLOBAL void wwviaudio_set_sound_pan(int channel, float pan);
+
 /* Silence all channels but the music channel (pointers still advance though) */
 GLOBAL void wwviaudio_silence_sound_effects(void);
 
@@ -137,6 +255,44 @@ GLOBAL void wwviaudio_toggle_sound_effects(void);
 /* Stop playing the playing buffer from the given channel */
 GLOBAL void wwviaudio_cancel_sound(int channel);
 
+/* Set the volume (0.0 = silent, 1.0 = full, the default) of a channel.
+ * Channels whose volume falls below the audibility threshold become
+ * virtual: they keep their place in the sound but cost no mixing.
+ */
+GLOBAL void wwviaudio_set_sound_volume(int channel, float volume);
+
+/* Volume below which a channel is considered inaudible. Default 0.001. */
+GLOBAL void wwviaudio_set_audibility_threshold(float threshold);
+
+/* Mix at most nvoices channels, the loudest ones.  The rest are virtual
+ * until they are loud enough to make the cut.  0 (the default) means
+ * every audible channel is mixed.
+ */
+GLOBAL void wwviaudio_set_max_real_voices(int nvoices);
+
+/* Report how many channels were mixed (real) and how many only
+ * advanced (virtual) in the most recent audio buffer.
+ */
+GLOBAL void wwviaudio_get_voice_counts(int *real, int *virtual);
+
+/*
+ *             Reverb send bus functions
+ */
+
+/* All channels share a single reverb on a send bus.  Each channel
+ * feeds the bus at its own send level, 0.0 (dry, the default) to 1.0.
+ */
+GLOBAL void wwviaudio_set_reverb_send(int channel, float level);
+
+/* Like wwviaudio_add_sound, but with the given reverb send level. */
+GLOBAL /* channel */ int wwviaudio_add_sound_with_reverb(int sound_number, float send);
+
+/* Set the character of the bus reverb: decay_seconds is the time for
+ * the tail to fall by 60dB, damping (0.0 - 0.95) darkens the tail, and
+ * level is the gain of the reverb return into the mix.
+ */
+GLOBAL void wwviaudio_set_reverb(float decay_seconds, float damping, float level);
+
 
 /* Stop playing the playing buffer from all channels */
 GLOBAL void wwviaudio_cancel_all_sounds(void);